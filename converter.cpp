@@ -3,455 +3,2844 @@
 #include <vector>
 #include <cmath>
 #include <cstring>
+#include <cstdio>
+#include <cstdint>
 #include <algorithm>
+#include <stdexcept>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PNG_SSE2 1
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#include <immintrin.h>
+#define PNG_SSSE3_DISPATCH 1
+#define JPEG_AVX_DISPATCH 1
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define INPUT_FILE_MMAP 1
+#endif
+
+// ============= FILE INPUT =============
+
+// The bytes of an input file. Regular files are memory-mapped read-only
+// and read front to back, so the decoder parses the page cache directly
+// with no copy. Pipes, other special files and platforms without mmap are
+// read into memory instead.
+class InputFile {
+private:
+    const uint8_t* bytes;
+    size_t length;
+    bool mapped;
+    std::vector<uint8_t> buffer;
+
+public:
+    InputFile() : bytes(nullptr), length(0), mapped(false) {}
+    ~InputFile() { close(); }
+    InputFile(const InputFile&) = delete;
+    InputFile& operator=(const InputFile&) = delete;
+
+    bool open(const std::string& filename) {
+        close();
+#ifdef INPUT_FILE_MMAP
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            void* map = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, (size_t)info.st_size, MADV_SEQUENTIAL);
+                ::close(fd);
+                bytes = static_cast<const uint8_t*>(map);
+                length = (size_t)info.st_size;
+                mapped = true;
+                return true;
+            }
+        }
+        ::close(fd);
+#endif
+        return readAll(filename);
+    }
+
+    void close() {
+#ifdef INPUT_FILE_MMAP
+        if (mapped) munmap(const_cast<uint8_t*>(bytes), length);
+#endif
+        bytes = nullptr;
+        length = 0;
+        mapped = false;
+        buffer.clear();
+    }
+
+    const uint8_t* data() const { return bytes; }
+    size_t size() const { return length; }
+    const uint8_t& operator[](size_t i) const { return bytes[i]; }
+
+private:
+    // Reads until end of file without asking for its size first, which
+    // also works for pipes.
+    bool readAll(const std::string& filename) {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file) return false;
+
+        const size_t CHUNK = 1 << 20;
+        size_t used = 0;
+        while (file) {
+            buffer.resize(used + CHUNK);
+            file.read(reinterpret_cast<char*>(&buffer[used]), CHUNK);
+            used += (size_t)file.gcount();
+        }
+        buffer.resize(used);
+        bytes = buffer.data();
+        length = used;
+        return true;
+    }
+};
 
 // ============= ZLIB/DEFLATE DECOMPRESSION =============
 
+// A run of input bytes that lives in someone else's buffer, such as the
+// payload of one IDAT chunk inside the loaded file.
+struct ByteSpan {
+    const uint8_t* data;
+    size_t size;
+};
+
+// Reads deflate's LSB-first bit stream through a 64-bit accumulator that is
+// refilled a word at a time, so bounds are checked once per refill rather
+// than once per bit. The stream may be split across any number of spans;
+// the reader moves on to the next span when the current one runs out, so
+// split input never has to be joined into one buffer.
 class BitReader {
 private:
-    const std::vector<uint8_t>& data;
-    size_t bytePos;
-    int bitPos;
+    const std::vector<ByteSpan>& spans;
+    size_t spanIndex;
+    size_t spanBase;        // Stream offset of the current span
+    const uint8_t* data;    // Current span
+    size_t size;
+    size_t bytePos;         // Next byte of the current span to load
+    uint64_t bitBuf;
+    int bitCount;
 
-public:
-    BitReader(const std::vector<uint8_t>& d) : data(d), bytePos(0), bitPos(0) {}
+    bool nextSpan() {
+        while (bytePos == size) {
+            if (spanIndex + 1 >= spans.size()) return false;
+            spanBase += size;
+            spanIndex++;
+            data = spans[spanIndex].data;
+            size = spans[spanIndex].size;
+            bytePos = 0;
+        }
+        return true;
+    }
 
-    uint32_t readBits(int n) {
-        uint32_t result = 0;
-        for (int i = 0; i < n; i++) {
-            if (bytePos >= data.size()) throw std::runtime_error("Unexpected end of data");
-            result |= (((data[bytePos] >> bitPos) & 1) << i);
-            bitPos++;
-            if (bitPos == 8) {
-                bitPos = 0;
-                bytePos++;
+    void refill() {
+        if (size - bytePos >= 8) {
+            uint64_t word = 0;
+            for (int i = 7; i >= 0; i--) {
+                word = (word << 8) | data[bytePos + i];
+            }
+            bitBuf |= word << bitCount;
+            bytePos += (63 - bitCount) >> 3;
+            bitCount |= 56;
+        } else {
+            while (bitCount <= 56 && nextSpan()) {
+                bitBuf |= (uint64_t)data[bytePos++] << bitCount;
+                bitCount += 8;
             }
         }
+    }
+
+public:
+    BitReader(const std::vector<ByteSpan>& input)
+        : spans(input), spanIndex(0), spanBase(0), data(nullptr), size(0), bytePos(0), bitBuf(0), bitCount(0) {
+        if (!spans.empty()) {
+            data = spans[0].data;
+            size = spans[0].size;
+        }
+    }
+
+    // Bit offset of the next unread bit from the start of the stream.
+    uint64_t position() const {
+        return (uint64_t)(spanBase + bytePos) * 8 - bitCount;
+    }
+
+    void seek(uint64_t bitOffset) {
+        size_t byteOffset = bitOffset >> 3;
+        spanIndex = 0;
+        spanBase = 0;
+        while (spanIndex + 1 < spans.size() && spanBase + spans[spanIndex].size <= byteOffset) {
+            spanBase += spans[spanIndex].size;
+            spanIndex++;
+        }
+        data = spans.empty() ? nullptr : spans[spanIndex].data;
+        size = spans.empty() ? 0 : spans[spanIndex].size;
+        bytePos = std::min(byteOffset - spanBase, size);
+        bitBuf = 0;
+        bitCount = 0;
+        readBits(bitOffset & 7);
+    }
+
+    // Returns the next n bits (n <= 32) without consuming them; bits past the
+    // end of the data read as zero.
+    uint32_t peek(int n) {
+        if (bitCount < n) refill();
+        return (uint32_t)(bitBuf & ((1ull << n) - 1));
+    }
+
+    void consume(int n) {
+        if (n > bitCount) throw std::runtime_error("Unexpected end of data");
+        bitBuf >>= n;
+        bitCount -= n;
+    }
+
+    uint32_t readBits(int n) {
+        uint32_t result = peek(n);
+        consume(n);
         return result;
     }
 
     void alignToByte() {
-        if (bitPos != 0) {
-            bitPos = 0;
-            bytePos++;
+        consume(bitCount & 7);
+    }
+
+    // Copies n whole bytes; the reader must be byte aligned.
+    void copyBytes(uint8_t* dst, size_t n) {
+        while (n > 0 && bitCount >= 8) {
+            *dst++ = (uint8_t)bitBuf;
+            bitBuf >>= 8;
+            bitCount -= 8;
+            n--;
+        }
+        if (n == 0) return;
+        bitBuf = 0;
+
+        while (n > 0) {
+            if (!nextSpan()) throw std::runtime_error("Unexpected end of data");
+            size_t count = std::min(n, size - bytePos);
+            std::memcpy(dst, data + bytePos, count);
+            bytePos += count;
+            dst += count;
+            n -= count;
         }
     }
 };
 
-class HuffmanTree {
+class HuffmanTable {
 private:
-    struct Node {
-        int value;
-        Node* left;
-        Node* right;
-        Node(int v = -1) : value(v), left(nullptr), right(nullptr) {}
-    };
+    // Entries pack a symbol (bits 0-15) and its code length (bits 16-23).
+    // Entries with LINK_FLAG set point at a subtable for codes longer than
+    // the primary index: bits 0-15 hold its offset, bits 16-23 its index width.
+    static const uint32_t LINK_FLAG = 1u << 24;
+    static const int MAX_BITS = 15;
+    static const int MAX_SYMBOLS = 288;
+    static const int PRIMARY_BITS = 9;
 
-    Node* root;
+    std::vector<uint32_t> table;
+    int primaryBits;
+    bool complete;
 
 public:
-    HuffmanTree() : root(nullptr) {}
+    HuffmanTable() : primaryBits(0), complete(false) {}
 
-    ~HuffmanTree() {
-        destroyTree(root);
-    }
+    // True if the code lengths use up the whole code space. Valid deflate
+    // streams only leave it incomplete for a code with a single symbol.
+    bool isComplete() const { return complete; }
 
-    void buildFromLengths(const std::vector<int>& lengths) {
-        destroyTree(root);
-        root = new Node();
+    // Rebuilding reuses the table's storage, so a table kept across blocks
+    // stops allocating once it has seen its largest code.
+    void buildFromLengths(const uint8_t* lengths, int count) {
+        table.clear();
+        primaryBits = 0;
+        complete = false;
+        if (count > MAX_SYMBOLS) throw std::runtime_error("Too many Huffman symbols");
 
         int maxLen = 0;
-        for (int len : lengths) {
-            if (len > maxLen) maxLen = len;
+        for (int i = 0; i < count; i++) {
+            if (lengths[i] > MAX_BITS) throw std::runtime_error("Invalid Huffman code length");
+            if (lengths[i] > maxLen) maxLen = lengths[i];
         }
         if (maxLen == 0) return;
 
-        std::vector<int> blCount(maxLen + 1, 0);
-        for (int len : lengths) {
-            if (len > 0) blCount[len]++;
+        int blCount[MAX_BITS + 1] = {0};
+        for (int i = 0; i < count; i++) {
+            if (lengths[i] > 0) blCount[lengths[i]]++;
         }
 
-        std::vector<int> nextCode(maxLen + 1, 0);
+        int left = 1;
+        for (int bits = 1; bits <= MAX_BITS; bits++) {
+            left = (left << 1) - blCount[bits];
+            if (left < 0) throw std::runtime_error("Over-subscribed Huffman code");
+        }
+        complete = left == 0;
+
+        int nextCode[MAX_BITS + 1] = {0};
         int code = 0;
         for (int bits = 1; bits <= maxLen; bits++) {
             code = (code + blCount[bits - 1]) << 1;
             nextCode[bits] = code;
         }
 
-        for (size_t i = 0; i < lengths.size(); i++) {
+        // Deflate packs codes MSB-first into an LSB-first stream, so tables are
+        // indexed by the bit-reversed code.
+        primaryBits = std::min(maxLen, (int)PRIMARY_BITS);
+        uint32_t primarySize = 1u << primaryBits;
+        uint32_t primaryMask = primarySize - 1;
+        uint16_t codes[MAX_SYMBOLS];
+        uint8_t subBits[1 << PRIMARY_BITS] = {0};
+
+        for (int i = 0; i < count; i++) {
             int len = lengths[i];
-            if (len > 0) {
-                insertCode(root, nextCode[len], len, i);
-                nextCode[len]++;
+            if (len == 0) continue;
+            codes[i] = reverseBits(nextCode[len]++, len);
+            if (len > primaryBits) {
+                uint8_t& width = subBits[codes[i] & primaryMask];
+                width = std::max<uint8_t>(width, len - primaryBits);
             }
         }
-    }
 
-    int decode(BitReader& reader) {
-        if (!root) return -1;
-        Node* node = root;
-        while (node && node->value == -1) {
-            int bit = reader.readBits(1);
-            node = (bit == 0) ? node->left : node->right;
+        table.assign(primarySize, 0);
+        for (uint32_t slot = 0; slot < primarySize; slot++) {
+            if (subBits[slot] == 0) continue;
+            uint32_t offset = table.size();
+            table.resize(offset + (1u << subBits[slot]), 0);
+            table[slot] = LINK_FLAG | ((uint32_t)subBits[slot] << 16) | offset;
         }
-        return node ? node->value : -1;
-    }
 
-private:
-    void insertCode(Node* node, int code, int len, int value) {
-        for (int i = len - 1; i >= 0; i--) {
-            int bit = (code >> i) & 1;
-            if (bit == 0) {
-                if (!node->left) node->left = new Node();
-                node = node->left;
+        for (int i = 0; i < count; i++) {
+            int len = lengths[i];
+            if (len == 0) continue;
+            uint32_t entry = ((uint32_t)len << 16) | (uint32_t)i;
+            if (len <= primaryBits) {
+                for (uint32_t j = codes[i]; j < primarySize; j += 1u << len) {
+                    table[j] = entry;
+                }
             } else {
-                if (!node->right) node->right = new Node();
-                node = node->right;
+                uint32_t link = table[codes[i] & primaryMask];
+                uint32_t offset = link & 0xFFFF;
+                uint32_t subSize = 1u << ((link >> 16) & 0xFF);
+                for (uint32_t j = codes[i] >> primaryBits; j < subSize; j += 1u << (len - primaryBits)) {
+                    table[offset + j] = entry;
+                }
             }
         }
-        node->value = value;
     }
 
-    void destroyTree(Node* node) {
-        if (!node) return;
-        destroyTree(node->left);
-        destroyTree(node->right);
-        delete node;
+    int decode(BitReader& reader) const {
+        if (table.empty()) throw std::runtime_error("Invalid Huffman code");
+        uint32_t bits = reader.peek(MAX_BITS);
+        uint32_t entry = table[bits & ((1u << primaryBits) - 1)];
+        if (entry & LINK_FLAG) {
+            uint32_t subMask = (1u << ((entry >> 16) & 0xFF)) - 1;
+            entry = table[(entry & 0xFFFF) + ((bits >> primaryBits) & subMask)];
+        }
+        int len = (entry >> 16) & 0xFF;
+        if (len == 0) throw std::runtime_error("Invalid Huffman code");
+        reader.consume(len);
+        return entry & 0xFFFF;
+    }
+
+private:
+    static uint16_t reverseBits(int code, int len) {
+        uint16_t result = 0;
+        for (int i = 0; i < len; i++) {
+            result = (result << 1) | ((code >> i) & 1);
+        }
+        return result;
     }
 };
 
 class Deflate {
+    friend class ParallelInflate;
+    friend class InflateStream;
+
 public:
-    static std::vector<uint8_t> decompress(const std::vector<uint8_t>& compressed) {
-        BitReader reader(compressed);
-        std::vector<uint8_t> result;
+    // Checks and skips the two-byte zlib header in front of the deflate data.
+    static void readZlibHeader(BitReader& reader) {
+        uint32_t cmf = reader.readBits(8);
+        uint32_t flg = reader.readBits(8);
+        if ((cmf & 0x0F) != 8 || (cmf >> 4) > 7) throw std::runtime_error("Unsupported zlib compression method");
+        if ((cmf * 256 + flg) % 31 != 0) throw std::runtime_error("Corrupt zlib header");
+        if (flg & 0x20) throw std::runtime_error("Preset zlib dictionaries are not supported");
+    }
 
-        while (true) {
+    // Inflates a raw deflate stream into a buffer of exactly expectedSize
+    // bytes; streams that would produce more or less output are rejected.
+    static std::vector<uint8_t> decompress(BitReader& reader, size_t expectedSize) {
+        std::vector<uint8_t> result(expectedSize);
+        inflate(reader, result.data(), expectedSize);
+        return result;
+    }
+
+    // Inflates exactly size bytes into dst. Decoding stops at the final block
+    // or at the end of the block that fills dst, so nothing after that (such
+    // as the zlib checksum or a flush marker) is read.
+    static void inflate(BitReader& reader, uint8_t* dst, size_t size) {
+        uint8_t* out = dst;
+        inflateBlocks(reader, dst, out, dst + size, UINT64_MAX);
+        if (out != dst + size) throw std::runtime_error("Inflated data shorter than expected");
+    }
+
+    // Inflates whole blocks to out until the final block, a full buffer, or
+    // a block boundary at or past stopBit. Back-references may reach back to
+    // outStart. Returns true if the final block was decoded.
+    static bool inflateBlocks(BitReader& reader, const uint8_t* outStart, uint8_t*& out, uint8_t* outEnd,
+                              uint64_t stopBit) {
+        // Kept across blocks so dynamic blocks reuse their table storage.
+        HuffmanTable codeTable, litTable, distTable;
+
+        while (out != outEnd && reader.position() < stopBit) {
             int finalBlock = reader.readBits(1);
             int blockType = reader.readBits(2);
 
             if (blockType == 0) {
                 reader.alignToByte();
-                uint16_t len = reader.readBits(16);
-                reader.readBits(16);
-                for (int i = 0; i < len; i++) {
-                    result.push_back(reader.readBits(8));
-                }
+                uint32_t len = reader.readBits(16);
+                uint32_t nlen = reader.readBits(16);
+                if ((len ^ 0xFFFF) != nlen) throw std::runtime_error("Corrupt stored block length");
+                if (len > (size_t)(outEnd - out)) throw std::runtime_error("Inflated data exceeds expected size");
+                reader.copyBytes(out, len);
+                out += len;
             } else if (blockType == 1) {
-                std::vector<int> litLenLengths(288);
-                std::vector<int> distLengths(32);
+                const FixedTables& fixed = fixedTables();
+                inflateBlockData(reader, fixed.litLen, fixed.dist, outStart, out, outEnd, nullptr);
+            } else if (blockType == 2) {
+                readDynamicTables(reader, codeTable, litTable, distTable);
+                inflateBlockData(reader, litTable, distTable, outStart, out, outEnd, nullptr);
+            } else {
+                throw std::runtime_error("Invalid block type");
+            }
 
-                for (int i = 0; i <= 143; i++) litLenLengths[i] = 8;
-                for (int i = 144; i <= 255; i++) litLenLengths[i] = 9;
-                for (int i = 256; i <= 279; i++) litLenLengths[i] = 7;
-                for (int i = 280; i <= 287; i++) litLenLengths[i] = 8;
-                for (int i = 0; i < 32; i++) distLengths[i] = 5;
+            if (finalBlock) return true;
+        }
+        return false;
+    }
 
-                inflateBlockData(reader, litLenLengths, distLengths, result);
-            } else if (blockType == 2) {
-                int hlit = reader.readBits(5) + 257;
-                int hdist = reader.readBits(5) + 1;
-                int hclen = reader.readBits(4) + 4;
-
-                std::vector<int> codeLenLengths(19, 0);
-                static const int codeOrder[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
-                for (int i = 0; i < hclen; i++) {
-                    codeLenLengths[codeOrder[i]] = reader.readBits(3);
-                }
+private:
+    static const int lengthBase[29];
+    static const int lengthExtra[29];
+    static const int distBase[30];
+    static const int distExtra[30];
 
-                HuffmanTree codeTree;
-                codeTree.buildFromLengths(codeLenLengths);
-
-                std::vector<int> litLenLengths(hlit);
-                std::vector<int> distLengths(hdist);
-                int total = hlit + hdist;
-                int i = 0;
-
-                while (i < total) {
-                    int code = codeTree.decode(reader);
-                    if (code < 16) {
-                        if (i < hlit) litLenLengths[i] = code;
-                        else distLengths[i - hlit] = code;
-                        i++;
-                    } else if (code == 16) {
-                        int count = reader.readBits(2) + 3;
-                        int val = (i < hlit) ? litLenLengths[i - 1] : distLengths[i - hlit - 1];
-                        for (int j = 0; j < count; j++) {
-                            if (i < hlit) litLenLengths[i] = val;
-                            else distLengths[i - hlit] = val;
-                            i++;
-                        }
-                    } else if (code == 17) {
-                        int count = reader.readBits(3) + 3;
-                        for (int j = 0; j < count; j++) {
-                            if (i < hlit) litLenLengths[i] = 0;
-                            else distLengths[i - hlit] = 0;
-                            i++;
-                        }
-                    } else if (code == 18) {
-                        int count = reader.readBits(7) + 11;
-                        for (int j = 0; j < count; j++) {
-                            if (i < hlit) litLenLengths[i] = 0;
-                            else distLengths[i - hlit] = 0;
-                            i++;
-                        }
-                    }
-                }
+    // The part of a match that did not fit before outEnd.
+    struct PendingMatch {
+        int length;
+        int distance;
+    };
 
-                inflateBlockData(reader, litLenLengths, distLengths, result);
-            }
+    // The fixed Huffman codes of BTYPE=01 blocks, built once per process.
+    struct FixedTables {
+        HuffmanTable litLen;
+        HuffmanTable dist;
 
-            if (finalBlock) break;
+        FixedTables() {
+            uint8_t litLenLengths[288];
+            uint8_t distLengths[32];
+            for (int i = 0; i <= 143; i++) litLenLengths[i] = 8;
+            for (int i = 144; i <= 255; i++) litLenLengths[i] = 9;
+            for (int i = 256; i <= 279; i++) litLenLengths[i] = 7;
+            for (int i = 280; i <= 287; i++) litLenLengths[i] = 8;
+            for (int i = 0; i < 32; i++) distLengths[i] = 5;
+            litLen.buildFromLengths(litLenLengths, 288);
+            dist.buildFromLengths(distLengths, 32);
         }
+    };
 
-        return result;
+    static const FixedTables& fixedTables() {
+        static const FixedTables tables;
+        return tables;
     }
 
-private:
-    static void inflateBlockData(BitReader& reader, const std::vector<int>& litLenLengths,
-                                 const std::vector<int>& distLengths, std::vector<uint8_t>& result) {
-        HuffmanTree litTree, distTree;
-        litTree.buildFromLengths(litLenLengths);
-        distTree.buildFromLengths(distLengths);
+    static void readDynamicTables(BitReader& reader, HuffmanTable& codeTable,
+                                  HuffmanTable& litTable, HuffmanTable& distTable) {
+        int hlit = reader.readBits(5) + 257;
+        int hdist = reader.readBits(5) + 1;
+        int hclen = reader.readBits(4) + 4;
+        if (hlit > 286 || hdist > 30) throw std::runtime_error("Invalid dynamic block header");
+
+        uint8_t codeLenLengths[19] = {0};
+        static const int codeOrder[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        for (int i = 0; i < hclen; i++) {
+            codeLenLengths[codeOrder[i]] = reader.readBits(3);
+        }
+        codeTable.buildFromLengths(codeLenLengths, 19);
+
+        // Literal/length and distance code lengths form one sequence, and
+        // repeats may run across the boundary between them.
+        uint8_t lengths[286 + 30];
+        int total = hlit + hdist;
+        int i = 0;
+
+        while (i < total) {
+            int code = codeTable.decode(reader);
+            if (code < 16) {
+                lengths[i++] = code;
+                continue;
+            }
+
+            int count;
+            uint8_t val = 0;
+            if (code == 16) {
+                if (i == 0) throw std::runtime_error("Repeat with no previous code length");
+                val = lengths[i - 1];
+                count = reader.readBits(2) + 3;
+            } else if (code == 17) {
+                count = reader.readBits(3) + 3;
+            } else {
+                count = reader.readBits(7) + 11;
+            }
+            if (i + count > total) throw std::runtime_error("Code length repeat overflows table");
+            std::memset(lengths + i, val, count);
+            i += count;
+        }
 
-        static const int lengthExtra[] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
-        static const int lengthBase[] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
-        static const int distExtra[] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
-        static const int distBase[] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+        if (lengths[256] == 0) throw std::runtime_error("Missing end-of-block code");
+        litTable.buildFromLengths(lengths, hlit);
+        distTable.buildFromLengths(lengths + hlit, hdist);
+    }
 
+    // Decodes the symbols of one block to out and returns true at its
+    // end-of-block code. Output past outEnd is an error unless pending is
+    // given; then decoding stops with false once out reaches outEnd, and the
+    // rest of a match cut off there is left in pending.
+    static bool inflateBlockData(BitReader& reader, const HuffmanTable& litTable,
+                                 const HuffmanTable& distTable,
+                                 const uint8_t* outStart, uint8_t*& out, uint8_t* outEnd,
+                                 PendingMatch* pending) {
         while (true) {
-            int code = litTree.decode(reader);
+            if (pending && out == outEnd) return false;
+            int code = litTable.decode(reader);
             if (code < 256) {
-                result.push_back(code);
+                if (out == outEnd) throw std::runtime_error("Inflated data exceeds expected size");
+                *out++ = (uint8_t)code;
             } else if (code == 256) {
-                break;
+                return true;
             } else if (code < 286) {
                 int lenCode = code - 257;
                 int length = lengthBase[lenCode] + reader.readBits(lengthExtra[lenCode]);
-                int distCode = distTree.decode(reader);
+                int distCode = distTable.decode(reader);
+                if (distCode >= 30) throw std::runtime_error("Invalid distance code");
                 int distance = distBase[distCode] + reader.readBits(distExtra[distCode]);
-                for (int i = 0; i < length; i++) {
-                    result.push_back(result[result.size() - distance]);
+                if (distance > out - outStart) throw std::runtime_error("Distance too far back");
+                if (length > outEnd - out) {
+                    if (!pending) throw std::runtime_error("Inflated data exceeds expected size");
+                    pending->length = length - (int)(outEnd - out);
+                    pending->distance = distance;
+                    length = (int)(outEnd - out);
                 }
+                copyMatch(out, distance, length, outEnd);
+                out += length;
+            } else {
+                throw std::runtime_error("Invalid literal/length code");
             }
         }
     }
-};
-
-// ============= PNG DECODER =============
 
-struct PNGHeader {
-    uint32_t width;
-    uint32_t height;
-    uint8_t bitDepth;
-    uint8_t colorType;
-    uint8_t compressionMethod;
-    uint8_t filterMethod;
-    uint8_t interlaceMethod;
+    // Copies an LZ77 match to out. Away from the end of the buffer the copy
+    // runs in 16- or 8-byte chunks and may write up to 15 bytes past the
+    // match; later output overwrites them.
+    static void copyMatch(uint8_t* out, int distance, int length, const uint8_t* outEnd) {
+        const uint8_t* src = out - distance;
+        if (outEnd - out >= length + 16) {
+            if (distance == 1) {
+                std::memset(out, src[0], length);
+                return;
+            }
+            if (distance >= 16) {
+                for (int i = 0; i < length; i += 16) {
+                    std::memcpy(out + i, src + i, 16);
+                }
+                return;
+            }
+            if (distance >= 8) {
+                for (int i = 0; i < length; i += 8) {
+                    std::memcpy(out + i, src + i, 8);
+                }
+                return;
+            }
+        }
+        for (int i = 0; i < length; i++) {
+            out[i] = src[i];
+        }
+    }
 };
 
-class PNGDecoder {
-private:
-    std::vector<uint8_t> fileData;
-    PNGHeader header;
-    std::vector<uint8_t> imageData;
-    std::vector<uint8_t> palette;
+const int Deflate::lengthBase[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+const int Deflate::lengthExtra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+const int Deflate::distBase[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+const int Deflate::distExtra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+// Inflates a deflate stream one caller-sized piece at a time, such as one
+// scanline, so the whole output never has to be held at once. Only the
+// last 32 KB, which later matches may copy from, is kept between pieces;
+// blocks and matches may straddle piece boundaries.
+class InflateStream {
 public:
-    bool load(const std::string& filename) {
-        std::ifstream file(filename, std::ios::binary);
-        if (!file) return false;
+    static const size_t WINDOW_SIZE = 32768;
 
-        file.seekg(0, std::ios::end);
-        size_t size = file.tellg();
-        file.seekg(0, std::ios::beg);
+    // Pieces may be up to maxPiece bytes. When resuming mid-stream, window
+    // holds the output just before input's position.
+    InflateStream(BitReader& input, size_t maxPiece, const std::vector<uint8_t>& window = std::vector<uint8_t>())
+        : reader(input), pos(std::min(window.size(), (size_t)WINDOW_SIZE)), inBlock(false),
+          finalBlock(false), storedLeft(0), lit(nullptr), dist(nullptr) {
+        // Slack past one piece means the window is slid back only about
+        // every 256 KB of output.
+        size_t slack = std::max(4 * maxPiece, 8 * (size_t)WINDOW_SIZE);
+        buffer.resize(WINDOW_SIZE + slack);
+        std::copy(window.end() - pos, window.end(), buffer.begin());
+        pending.length = 0;
+        pending.distance = 0;
+    }
 
-        fileData.resize(size);
-        file.read(reinterpret_cast<char*>(fileData.data()), size);
-        file.close();
+    // Returns the next n bytes of output, valid until the following call.
+    // Throws if the stream is corrupt or ends first.
+    const uint8_t* next(size_t n) {
+        if (n > buffer.size() - pos) slideWindow();
+        if (n > buffer.size() - pos) throw std::runtime_error("Inflate piece too large");
 
-        if (!validateSignature()) return false;
-        if (!parseChunks()) return false;
+        uint8_t* out = &buffer[pos];
+        uint8_t* outEnd = out + n;
+        while (out != outEnd) {
+            if (pending.length > 0) {
+                int length = std::min<int>(pending.length, (int)(outEnd - out));
+                Deflate::copyMatch(out, pending.distance, length, outEnd);
+                out += length;
+                pending.length -= length;
+            } else if (storedLeft > 0) {
+                size_t length = std::min<size_t>(storedLeft, outEnd - out);
+                reader.copyBytes(out, length);
+                out += length;
+                storedLeft -= length;
+            } else if (inBlock) {
+                inBlock = !Deflate::inflateBlockData(reader, *lit, *dist, buffer.data(), out, outEnd, &pending);
+            } else {
+                readBlockHeader();
+            }
+        }
 
-        return true;
+        const uint8_t* piece = &buffer[pos];
+        pos += n;
+        return piece;
     }
 
-    std::vector<uint8_t> getRGB() {
-        std::vector<uint8_t> result;
+private:
+    BitReader& reader;
+    std::vector<uint8_t> buffer;
+    size_t pos;
+    bool inBlock;
+    bool finalBlock;
+    size_t storedLeft;
+    Deflate::PendingMatch pending;
+    const HuffmanTable* lit;
+    const HuffmanTable* dist;
+    HuffmanTable codeTable, litTable, distTable;
+
+    void readBlockHeader() {
+        if (finalBlock) throw std::runtime_error("Inflated data shorter than expected");
+        finalBlock = reader.readBits(1);
+        int blockType = reader.readBits(2);
+
+        if (blockType == 0) {
+            reader.alignToByte();
+            uint32_t len = reader.readBits(16);
+            uint32_t nlen = reader.readBits(16);
+            if ((len ^ 0xFFFF) != nlen) throw std::runtime_error("Corrupt stored block length");
+            storedLeft = len;
+        } else if (blockType == 1) {
+            const Deflate::FixedTables& fixed = Deflate::fixedTables();
+            lit = &fixed.litLen;
+            dist = &fixed.dist;
+            inBlock = true;
+        } else if (blockType == 2) {
+            Deflate::readDynamicTables(reader, codeTable, litTable, distTable);
+            lit = &litTable;
+            dist = &distTable;
+            inBlock = true;
+        } else {
+            throw std::runtime_error("Invalid block type");
+        }
+    }
+
+    // Moves the last 32 KB of output to the front of the buffer.
+    void slideWindow() {
+        size_t keep = std::min(pos, (size_t)WINDOW_SIZE);
+        std::memmove(buffer.data(), buffer.data() + pos - keep, keep);
+        pos = keep;
+    }
+};
 
-        if (header.colorType == 0) {
-            for (uint8_t val : imageData) {
-                result.push_back(val);
-                result.push_back(val);
-                result.push_back(val);
-            }
-        } else if (header.colorType == 2) {
-            result = imageData;
-        } else if (header.colorType == 3) {
-            for (uint8_t idx : imageData) {
-                if (idx * 3 + 2 < palette.size()) {
-                    result.push_back(palette[idx * 3]);
-                    result.push_back(palette[idx * 3 + 1]);
-                    result.push_back(palette[idx * 3 + 2]);
+// Speculative parallel inflate for large single-stream inputs, in the style
+// of pugz and rapidgzip. The compressed stream is cut into one chunk per
+// thread and each chunk is started from the first plausible block header
+// after its cut. Chunks are decoded without their 32 KB window: bytes that
+// copy from before the chunk are recorded as references into that window
+// and patched once the previous chunk is known. Once a chunk's last 32 KB
+// holds no such references, it goes on as a plain inflate. A chunk only
+// counts if the chunk before it stopped exactly at the header it was
+// started from; any other chunk is decoded again serially, so the output
+// always matches a serial inflate.
+#ifndef PARALLEL_INFLATE_MIN_BYTES
+#define PARALLEL_INFLATE_MIN_BYTES (4u << 20)
+#endif
+#ifndef PARALLEL_INFLATE_THREADS
+#define PARALLEL_INFLATE_THREADS 0   // 0 = one per hardware thread
+#endif
+// Speculation costs 1.1x to 1.4x the CPU time of a serial inflate, so it
+// needs at least this many threads to finish sooner.
+#ifndef PARALLEL_INFLATE_MIN_THREADS
+#define PARALLEL_INFLATE_MIN_THREADS 2
+#endif
+
+class ParallelInflate {
+public:
+    static unsigned threadCount() {
+        unsigned threads = PARALLEL_INFLATE_THREADS;
+        return threads ? threads : std::thread::hardware_concurrency();
+    }
+
+    // Runs task(0) .. task(count - 1) on up to threads threads, the calling
+    // thread included. If a task throws, the tasks not yet started are
+    // skipped and the first exception is rethrown here once every thread
+    // has been joined.
+    template <typename Task>
+    static void parallelFor(size_t count, unsigned threads, Task task) {
+        std::atomic<size_t> next(0);
+        std::exception_ptr error;
+        std::mutex errorMutex;
+        auto run = [&]() {
+            for (size_t i = next++; i < count; i = next++) {
+                try {
+                    task(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(errorMutex);
+                    if (!error) error = std::current_exception();
+                    next = count;
                 }
             }
-        } else if (header.colorType == 4) {
-            for (size_t i = 0; i < imageData.size(); i += 2) {
-                result.push_back(imageData[i]);
-                result.push_back(imageData[i]);
-                result.push_back(imageData[i]);
+        };
+        std::vector<std::thread> workers;
+        workers.reserve(std::min<size_t>(count, threads));
+        try {
+            for (unsigned t = 1; t < threads && t < count; t++) {
+                workers.emplace_back(run);
+            }
+        } catch (...) {
+            // Out of threads: the ones already running share the work.
+        }
+        run();
+        for (size_t t = 0; t < workers.size(); t++) {
+            workers[t].join();
+        }
+        if (error) std::rethrow_exception(error);
+    }
+
+    // Inflates exactly size bytes from the deflate stream starting at
+    // startBit. Returns false if the stream could not be decoded this way;
+    // the caller should then inflate it serially.
+    static bool decompress(const std::vector<ByteSpan>& input, uint64_t startBit,
+                           uint8_t* dst, size_t size, unsigned threads) {
+        if (threads < 2 || threads < PARALLEL_INFLATE_MIN_THREADS) return false;
+        uint64_t inputBytes = 0;
+        for (size_t i = 0; i < input.size(); i++) inputBytes += input[i].size;
+
+        std::vector<Chunk> chunks(threads);
+        chunks[0].startBit = startBit;
+        parallelFor(threads - 1, threads, [&](size_t i) {
+            chunks[i + 1].startBit = findBlockStart(input, inputBytes * (i + 1) / threads);
+        });
+
+        // Drop cuts that found no header or landed inside an earlier chunk.
+        size_t kept = 1;
+        for (size_t i = 1; i < chunks.size(); i++) {
+            if (chunks[i].startBit != NOT_FOUND && chunks[i].startBit > chunks[kept - 1].startBit) {
+                chunks[kept++].startBit = chunks[i].startBit;
+            }
+        }
+        chunks.resize(kept);
+        if (chunks.size() < 2) return false;
+
+        // The first chunk needs no window, so it is inflated straight into
+        // place. The others are sized from their share of the input.
+        parallelFor(chunks.size(), threads, [&](size_t i) {
+            uint64_t stopBit = i + 1 < chunks.size() ? chunks[i + 1].startBit : UINT64_MAX;
+            if (i == 0) {
+                inflateFirstChunk(input, chunks[0], stopBit, dst, size);
+                return;
+            }
+            uint64_t bits = std::min(stopBit, inputBytes * 8) - chunks[i].startBit;
+            size_t expected = (size_t)((double)size * bits / (inputBytes * 8));
+            decodeChunk(input, chunks[i], stopBit, size, expected);
+        });
+
+        // Stitch the chunks in order. Only the last window's worth of each
+        // chunk is resolved here, which is all the next chunk needs.
+        size_t outPos = 0;
+        uint64_t prevEnd = startBit;
+        bool finished = false;
+        for (size_t i = 0; i < chunks.size() && !finished; i++) {
+            Chunk& chunk = chunks[i];
+            uint64_t stopBit = i + 1 < chunks.size() ? chunks[i + 1].startBit : UINT64_MAX;
+            chunk.outStart = outPos;
+
+            if (chunk.failed || chunk.startBit != prevEnd) {
+                try {
+                    BitReader reader(input);
+                    reader.seek(prevEnd);
+                    uint8_t* out = dst + outPos;
+                    finished = Deflate::inflateBlocks(reader, dst, out, dst + size, stopBit);
+                    chunk.symbols.clear();
+                    chunk.resolved = true;
+                    outPos = out - dst;
+                    prevEnd = reader.position();
+                } catch (...) {
+                    return false;
+                }
+                if (outPos == size) finished = true;
+                continue;
             }
-        } else if (header.colorType == 6) {
-            for (size_t i = 0; i < imageData.size(); i += 4) {
-                result.push_back(imageData[i]);
-                result.push_back(imageData[i + 1]);
-                result.push_back(imageData[i + 2]);
+
+            if (chunk.resolved) {
+                outPos += chunk.inPlace;
+                prevEnd = chunk.endBit;
+                finished = chunk.finalBlock;
+                continue;
             }
+
+            size_t count = chunk.size();
+            if (count > size - outPos) return false;
+            if (!emit(chunk, dst, count > WINDOW_SIZE ? count - WINDOW_SIZE : 0, count)) return false;
+            outPos += count;
+            prevEnd = chunk.endBit;
+            finished = chunk.finalBlock;
         }
+        if (outPos != size) return false;
 
-        return result;
+        std::atomic<bool> ok(true);
+        parallelFor(chunks.size(), threads, [&](size_t i) {
+            Chunk& chunk = chunks[i];
+            size_t count = chunk.size();
+            if (chunk.resolved || count <= WINDOW_SIZE) return;
+            if (!emit(chunk, dst, 0, count - WINDOW_SIZE)) ok = false;
+        });
+        return ok;
     }
 
-    uint32_t getWidth() const { return header.width; }
-    uint32_t getHeight() const { return header.height; }
-
 private:
-    bool validateSignature() {
-        static const uint8_t sig[] = {137, 80, 78, 71, 13, 10, 26, 10};
-        if (fileData.size() < 8) return false;
-        for (int i = 0; i < 8; i++) {
-            if (fileData[i] != sig[i]) return false;
+    static const size_t WINDOW_SIZE = 32768;
+    static const size_t SEARCH_BYTES = 1 << 20;
+    static const size_t TRIAL_BYTES = 256 << 10;
+    static const size_t SYMBOL_BUFFER = 8 * WINDOW_SIZE;   // initial symbols per chunk
+    static const size_t MATCH_ROOM = 258 + 8;              // longest match plus copy overrun
+    static const uint64_t NOT_FOUND = UINT64_MAX;
+
+    struct Chunk {
+        uint64_t startBit;
+        uint64_t endBit;
+        size_t outStart;
+        size_t inPlace;     // bytes already inflated straight into the output
+        bool finalBlock;
+        bool failed;
+        bool resolved;
+        // Literal bytes, or WINDOW_MARKER + i for byte i of the 32 KB window
+        // that precedes the chunk.
+        std::vector<uint16_t> symbols;
+        // The output after symbols, once it no longer refers to that window.
+        std::vector<uint8_t> bytes;
+
+        Chunk() : startBit(0), endBit(0), outStart(0), inPlace(0), finalBlock(false), failed(false),
+                  resolved(false) {}
+
+        size_t size() const { return symbols.size() + bytes.size(); }
+    };
+
+    static const uint16_t WINDOW_MARKER = 256;
+
+
+    static bool resolve(const Chunk& chunk, uint8_t* dst, size_t begin, size_t end) {
+        const uint16_t* symbols = chunk.symbols.data();
+        uint8_t* out = dst + chunk.outStart;
+        for (size_t i = begin; i < end; i++) {
+            uint16_t symbol = symbols[i];
+            if (symbol < WINDOW_MARKER) {
+                out[i] = (uint8_t)symbol;
+                continue;
+            }
+            size_t back = WINDOW_SIZE - (symbol - WINDOW_MARKER);
+            if (back > chunk.outStart) return false;
+            out[i] = out[(ptrdiff_t)-back];
         }
         return true;
     }
 
-    uint32_t readBE32(size_t pos) const {
-        return ((uint32_t)fileData[pos] << 24) | ((uint32_t)fileData[pos + 1] << 16) |
-               ((uint32_t)fileData[pos + 2] << 8) | fileData[pos + 3];
+    // Writes bytes begin .. end of a chunk's output to its place in dst.
+    static bool emit(const Chunk& chunk, uint8_t* dst, size_t begin, size_t end) {
+        size_t split = chunk.symbols.size();
+        if (begin < split && !resolve(chunk, dst, begin, std::min(end, split))) return false;
+        if (end > split) {
+            size_t from = std::max(begin, split);
+            std::memcpy(dst + chunk.outStart + from, chunk.bytes.data() + (from - split), end - from);
+        }
+        return true;
     }
 
-    bool parseChunks() {
-        size_t pos = 8;
-        std::vector<uint8_t> compressedData;
+    // The first chunk starts where the stream does, so it has no window to
+    // miss.
+    static void inflateFirstChunk(const std::vector<ByteSpan>& input, Chunk& chunk, uint64_t stopBit,
+                                  uint8_t* dst, size_t size) {
+        try {
+            BitReader reader(input);
+            reader.seek(chunk.startBit);
+            uint8_t* out = dst;
+            chunk.finalBlock = Deflate::inflateBlocks(reader, dst, out, dst + size, stopBit);
+            chunk.endBit = reader.position();
+            chunk.inPlace = out - dst;
+            chunk.resolved = true;
+        } catch (...) {
+            chunk.failed = true;
+        }
+    }
 
-        while (pos + 12 <= fileData.size()) {
-            uint32_t length = readBE32(pos);
-            pos += 4;
+    static void decodeChunk(const std::vector<ByteSpan>& input, Chunk& chunk, uint64_t stopBit,
+                            size_t maxSymbols, size_t expected) {
+        try {
+            BitReader reader(input);
+            reader.seek(chunk.startBit);
+            chunk.finalBlock = decodeBlocks(reader, chunk, stopBit, maxSymbols, expected);
+            chunk.endBit = reader.position();
+        } catch (...) {
+            chunk.failed = true;
+            chunk.symbols.clear();
+            chunk.bytes.clear();
+        }
+    }
+
+    // Grows buffer to at least needed elements, but no more than limit.
+    // It at least doubles so that repeated growth stays linear.
+    template <typename T>
+    static void grow(std::vector<T>& buffer, size_t needed, size_t limit) {
+        if (needed > buffer.size()) buffer.resize(std::min(std::max(needed, 2 * buffer.size()), limit));
+    }
+
+    // Decodes whole blocks without a window until the final block or a
+    // block boundary at or past stopBit. Once the last 32 KB of symbols
+    // holds no window references no later match can produce one, so from
+    // the next block on the chunk is inflated as plain bytes instead.
+    // Returns true if the final block was decoded.
+    static bool decodeBlocks(BitReader& reader, Chunk& chunk, uint64_t stopBit, size_t maxSymbols,
+                             size_t expected) {
+        HuffmanTable codeTable, litTable, distTable;
+        std::vector<uint16_t>& symbols = chunk.symbols;
+        symbols.resize((expected < SYMBOL_BUFFER ? expected : SYMBOL_BUFFER) + MATCH_ROOM);
+        size_t count = 0;
+        size_t clearAt = WINDOW_SIZE;   // the earliest count the window can be clear at
+        bool finalBlock = false;
+
+        while (!finalBlock && reader.position() < stopBit) {
+            finalBlock = reader.readBits(1);
+            int blockType = reader.readBits(2);
+
+            if (blockType == 0) {
+                reader.alignToByte();
+                uint32_t len = reader.readBits(16);
+                uint32_t nlen = reader.readBits(16);
+                if ((len ^ 0xFFFF) != nlen) throw std::runtime_error("Corrupt stored block length");
+                if (len > maxSymbols - count) throw std::runtime_error("Inflated data exceeds expected size");
+                grow(symbols, count + len + MATCH_ROOM, maxSymbols + MATCH_ROOM);
+                uint8_t bytes[4096];
+                while (len > 0) {
+                    uint32_t n = std::min<uint32_t>(len, sizeof(bytes));
+                    reader.copyBytes(bytes, n);
+                    std::copy(bytes, bytes + n, symbols.begin() + count);
+                    count += n;
+                    len -= n;
+                }
+            } else if (blockType == 1) {
+                const Deflate::FixedTables& fixed = Deflate::fixedTables();
+                decodeBlockData(reader, fixed.litLen, fixed.dist, symbols, count, maxSymbols);
+            } else if (blockType == 2) {
+                Deflate::readDynamicTables(reader, codeTable, litTable, distTable);
+                decodeBlockData(reader, litTable, distTable, symbols, count, maxSymbols);
+            } else {
+                throw std::runtime_error("Invalid block type");
+            }
+
+            if (count >= clearAt) {
+                size_t clear = count;
+                while (clear > count - WINDOW_SIZE && symbols[clear - 1] < WINDOW_MARKER) clear--;
+                if (clear == count - WINDOW_SIZE) {
+                    chunk.bytes.assign(symbols.begin() + clear, symbols.begin() + count);
+                    symbols.resize(clear);
+                    size_t rest = expected > clear ? expected - clear : 0;
+                    return finalBlock || inflateTail(reader, chunk.bytes, stopBit, maxSymbols - clear, rest);
+                }
+                clearAt = clear + WINDOW_SIZE;
+            }
+        }
+        symbols.resize(count);
+        return finalBlock;
+    }
+
+    // Inflates whole blocks to the end of bytes, which already holds the
+    // 32 KB window, until the final block or a block boundary at or past
+    // stopBit. bytes grows toward expected and may end up to limit long.
+    // Returns true if the final block was decoded.
+    static bool inflateTail(BitReader& reader, std::vector<uint8_t>& bytes, uint64_t stopBit,
+                            size_t limit, size_t expected) {
+        HuffmanTable codeTable, litTable, distTable;
+        size_t count = bytes.size();
+        // One spare byte, so a block that ends exactly at limit still
+        // reaches its end-of-block code.
+        bytes.resize(std::min(std::max(expected, 2 * count), limit + 1));
+
+        while (reader.position() < stopBit) {
+            int finalBlock = reader.readBits(1);
+            int blockType = reader.readBits(2);
+
+            if (blockType == 0) {
+                reader.alignToByte();
+                uint32_t len = reader.readBits(16);
+                uint32_t nlen = reader.readBits(16);
+                if ((len ^ 0xFFFF) != nlen) throw std::runtime_error("Corrupt stored block length");
+                if (len > limit - count) throw std::runtime_error("Inflated data exceeds expected size");
+                grow(bytes, count + len, limit + 1);
+                reader.copyBytes(&bytes[count], len);
+                count += len;
+            } else {
+                const HuffmanTable* lit;
+                const HuffmanTable* dist;
+                if (blockType == 1) {
+                    const Deflate::FixedTables& fixed = Deflate::fixedTables();
+                    lit = &fixed.litLen;
+                    dist = &fixed.dist;
+                } else if (blockType == 2) {
+                    Deflate::readDynamicTables(reader, codeTable, litTable, distTable);
+                    lit = &litTable;
+                    dist = &distTable;
+                } else {
+                    throw std::runtime_error("Invalid block type");
+                }
+
+                // Each time the buffer fills up it is grown and the match
+                // cut off at its end is finished.
+                Deflate::PendingMatch pending = {0, 0};
+                while (true) {
+                    uint8_t* begin = bytes.data();
+                    uint8_t* out = begin + count;
+                    bool done = Deflate::inflateBlockData(reader, *lit, *dist, begin, out, begin + bytes.size(),
+                                                          &pending);
+                    count = out - begin;
+                    if (done) break;
+                    if (count + pending.length > limit) throw std::runtime_error("Inflated data exceeds expected size");
+                    grow(bytes, count + pending.length + 1, limit + 1);
+                    Deflate::copyMatch(&bytes[count], pending.distance, pending.length, bytes.data() + bytes.size());
+                    count += pending.length;
+                    pending.length = 0;
+                }
+            }
+
+            if (finalBlock) {
+                bytes.resize(count);
+                return true;
+            }
+        }
+        bytes.resize(count);
+        return false;
+    }
+
+    // Decodes the symbols of one block to symbols[count] onward, growing
+    // symbols so that MATCH_ROOM elements are always free past count.
+    static void decodeBlockData(BitReader& reader, const HuffmanTable& litTable, const HuffmanTable& distTable,
+                                std::vector<uint16_t>& symbols, size_t& count, size_t maxSymbols) {
+        while (true) {
+            if (symbols.size() - count < MATCH_ROOM) grow(symbols, count + MATCH_ROOM, maxSymbols + MATCH_ROOM);
+            int code = litTable.decode(reader);
+            if (code < 256) {
+                if (count == maxSymbols) throw std::runtime_error("Inflated data exceeds expected size");
+                symbols[count++] = (uint16_t)code;
+            } else if (code == 256) {
+                break;
+            } else if (code < 286) {
+                int lenCode = code - 257;
+                size_t length = Deflate::lengthBase[lenCode] + reader.readBits(Deflate::lengthExtra[lenCode]);
+                int distCode = distTable.decode(reader);
+                if (distCode >= 30) throw std::runtime_error("Invalid distance code");
+                size_t distance = Deflate::distBase[distCode] + reader.readBits(Deflate::distExtra[distCode]);
+
+                if (distance > count + WINDOW_SIZE) throw std::runtime_error("Distance too far back");
+                if (length > maxSymbols - count) throw std::runtime_error("Inflated data exceeds expected size");
+                copySymbols(&symbols[count], count, distance, length);
+                count += length;
+            } else {
+                throw std::runtime_error("Invalid literal/length code");
+            }
+        }
+    }
+
+    // Copies a match to out, which is pos symbols into the chunk. Bytes from
+    // before the chunk become window references. Like Deflate::copyMatch,
+    // it may write up to 7 symbols past the match.
+    static void copySymbols(uint16_t* out, size_t pos, size_t distance, size_t length) {
+        size_t i = 0;
+        if (distance > pos) {
+            uint16_t first = (uint16_t)(WINDOW_MARKER + WINDOW_SIZE - (distance - pos));
+            for (; i < length && i < distance - pos; i++) {
+                out[i] = (uint16_t)(first + i);
+            }
+        }
+        const uint16_t* src = out - distance;
+        if (distance >= 8) {
+            for (; i < length; i += 8) {
+                std::memcpy(out + i, src + i, 16);
+            }
+        } else if (distance == 1) {
+            std::fill(out + i, out + length, src[i]);
+        } else {
+            for (; i < length; i++) {
+                out[i] = src[i];
+            }
+        }
+    }
+
+    // Returns the bit offset of the first plausible block header at or after
+    // byteOffset, or NOT_FOUND. Only stored and dynamic blocks are looked
+    // for; fixed-block headers are too short to tell apart from noise.
+    static uint64_t findBlockStart(const std::vector<ByteSpan>& input, uint64_t byteOffset) {
+        std::vector<uint8_t> buffer;
+        buffer.reserve(SEARCH_BYTES + TRIAL_BYTES);
+        uint64_t spanStart = 0;
+        for (size_t i = 0; i < input.size() && buffer.size() < SEARCH_BYTES + TRIAL_BYTES; i++) {
+            uint64_t spanEnd = spanStart + input[i].size;
+            if (spanEnd > byteOffset) {
+                size_t from = byteOffset > spanStart ? byteOffset - spanStart : 0;
+                size_t count = std::min<size_t>(input[i].size - from, SEARCH_BYTES + TRIAL_BYTES - buffer.size());
+                buffer.insert(buffer.end(), input[i].data + from, input[i].data + from + count);
+            }
+            spanStart = spanEnd;
+        }
+
+        ByteSpan span = {buffer.data(), buffer.size()};
+        std::vector<ByteSpan> window(1, span);
+        BitReader reader(window);
+        uint64_t searchBits = (uint64_t)(buffer.size() < SEARCH_BYTES ? buffer.size() : SEARCH_BYTES) * 8;
+        for (uint64_t bit = 0; bit < searchBits; bit++) {
+            if (isBlockStart(reader, bit)) return byteOffset * 8 + bit;
+        }
+        return NOT_FOUND;
+    }
+
+    static bool isBlockStart(BitReader& reader, uint64_t bit) {
+        try {
+            return checkBlockStart(reader, bit);
+        } catch (...) {
+            return false;
+        }
+    }
+
+    static bool checkBlockStart(BitReader& reader, uint64_t bit) {
+        reader.seek(bit);
+        uint32_t headerBits = reader.peek(17);
+        if (headerBits & 1) return false;           // A final block can't be followed by a cut
+        int blockType = (headerBits >> 1) & 3;
+
+        if (blockType == 0) {
+            reader.consume(3);
+            int padding = 8 - (int)(reader.position() & 7);
+            if (padding < 8 && reader.readBits(padding) != 0) return false;
+            uint32_t len = reader.readBits(16);
+            return (len ^ 0xFFFF) == reader.readBits(16);
+        }
+        if (blockType != 2) return false;
+
+        // Cheap checks first: HLIT, HDIST and a complete code-length code.
+        int hlit = (headerBits >> 3) & 0x1F;
+        int hdist = (headerBits >> 8) & 0x1F;
+        int hclen = ((headerBits >> 13) & 0xF) + 4;
+        if (hlit > 29 || hdist > 29) return false;
+        reader.consume(17);
+        int counts[8] = {0};
+        for (int i = 0; i < hclen; i++) {
+            counts[reader.readBits(3)]++;
+        }
+        int left = 1;
+        for (int len = 1; len <= 7; len++) {
+            left = (left << 1) - counts[len];
+            if (left < 0) return false;
+        }
+        if (left != 0) return false;
+
+        // Then the full header and a trial decode of the whole block.
+        reader.seek(bit + 3);
+        HuffmanTable codeTable, litTable, distTable;
+        Deflate::readDynamicTables(reader, codeTable, litTable, distTable);
+        if (!litTable.isComplete()) return false;
+        std::vector<uint16_t> symbols;
+        size_t count = 0;
+        decodeBlockData(reader, litTable, distTable, symbols, count, TRIAL_BYTES * 8);
+        return (reader.peek(3) >> 1) != 3;
+    }
+};
+
+// ============= PNG DECODER =============
+
+struct PNGHeader {
+    uint32_t width;
+    uint32_t height;
+    uint8_t bitDepth;
+    uint8_t colorType;
+    uint8_t compressionMethod;
+    uint8_t filterMethod;
+    uint8_t interlaceMethod;
+};
+
+// What PNGDecoder::probe learns from the chunk list alone.
+struct PNGInfo {
+    PNGHeader header;
+    uint64_t idatBytes;
+    size_t idatChunks;
+    bool segmented;         // has an iDOT chunk
+    uint64_t decodeBytes;   // estimated peak memory of a full decode
+};
+
+// Random-access checkpoints into a PNG's IDAT stream, in the manner of
+// zlib's zran example. Each point sits on a deflate block boundary and
+// carries what is needed to resume decoding there: the last 32 KB of
+// filtered output for back-references, and the unfiltered row above the
+// first whole row after it, so unfiltering can resume too. An index is
+// tied to one file by its size and a fingerprint of its IHDR and IDAT
+// chunks, and is kept next to it as a sidecar file.
+struct PNGIndex {
+    static const uint32_t WINDOW_SIZE = 32768;
+    static const uint64_t SPACING = 1u << 20;  // filtered bytes between points
+
+    struct Point {
+        uint64_t bitOffset;  // into the concatenated IDAT payloads
+        uint64_t outOffset;  // into the filtered image data
+        std::vector<uint8_t> window;
+        std::vector<uint8_t> prevRow;
+    };
+
+    uint64_t fileSize;
+    uint64_t fingerprint;
+    std::vector<Point> points;
+
+    PNGIndex() : fileSize(0), fingerprint(0) {}
+
+    static std::string sidecarName(const std::string& filename) {
+        return filename + ".idx";
+    }
+
+    bool save(const std::string& filename) const {
+        std::ofstream file(filename, std::ios::binary);
+        if (!file) return false;
+
+        file.write("PNGIDX1", 8);
+        writeLE64(file, fileSize);
+        writeLE64(file, fingerprint);
+        writeLE64(file, points.size());
+        for (size_t i = 0; i < points.size(); i++) {
+            const Point& point = points[i];
+            writeLE64(file, point.bitOffset);
+            writeLE64(file, point.outOffset);
+            writeLE64(file, point.window.size());
+            file.write(reinterpret_cast<const char*>(point.window.data()), point.window.size());
+            writeLE64(file, point.prevRow.size());
+            file.write(reinterpret_cast<const char*>(point.prevRow.data()), point.prevRow.size());
+        }
+        return (bool)file;
+    }
+
+    // rowBytes is the unfiltered row length of the image the index is for;
+    // a stored row of any other length means the file is corrupt or stale,
+    // and is rejected before anything is allocated for it.
+    bool load(const std::string& filename, size_t rowBytes) {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file) return false;
+
+        char magic[8];
+        if (!file.read(magic, 8) || std::memcmp(magic, "PNGIDX1", 8) != 0) return false;
+        uint64_t count = 0;
+        if (!readLE64(file, fileSize) || !readLE64(file, fingerprint) || !readLE64(file, count)) return false;
+
+        points.clear();
+        for (uint64_t i = 0; i < count; i++) {
+            Point point;
+            uint64_t windowSize = 0, prevRowSize = 0;
+            if (!readLE64(file, point.bitOffset) || !readLE64(file, point.outOffset)) return false;
+            if (!readLE64(file, windowSize) || windowSize > WINDOW_SIZE) return false;
+            point.window.resize(windowSize);
+            if (!file.read(reinterpret_cast<char*>(point.window.data()), windowSize)) return false;
+            if (!readLE64(file, prevRowSize) || (prevRowSize != 0 && prevRowSize != rowBytes)) return false;
+            point.prevRow.resize(prevRowSize);
+            if (!file.read(reinterpret_cast<char*>(point.prevRow.data()), prevRowSize)) return false;
+            points.push_back(point);
+        }
+        return true;
+    }
+
+private:
+    static void writeLE64(std::ofstream& file, uint64_t value) {
+        char bytes[8];
+        for (int i = 0; i < 8; i++) bytes[i] = (char)(value >> (8 * i));
+        file.write(bytes, 8);
+    }
+
+    static bool readLE64(std::ifstream& file, uint64_t& value) {
+        uint8_t bytes[8];
+        if (!file.read(reinterpret_cast<char*>(bytes), 8)) return false;
+        value = 0;
+        for (int i = 0; i < 8; i++) value |= (uint64_t)bytes[i] << (8 * i);
+        return true;
+    }
+};
+
+// Reverses PNG scanline filters one row at a time. Each filter type has its
+// own loop, specialised on the pixel size so the left and upper-left
+// neighbours are fixed offsets. With SSE2, Up runs 16 bytes per step, and
+// Sub, Average and Paeth one whole pixel per step for 3- to 8-byte pixels;
+// 1- and 2-byte pixels stay scalar, where a pixel step gains nothing.
+class Unfilter {
+public:
+    // Reconstructs length bytes of a row into out from its filtered bytes
+    // and the reconstructed row above, which is all zeros for the first row.
+    // Unknown filter types are copied through unchanged.
+    static void row(uint8_t filterType, uint32_t bpp, const uint8_t* filtered, const uint8_t* prev,
+                    uint8_t* out, size_t length) {
+        switch (bpp) {
+            case 1: row<1>(filterType, filtered, prev, out, length); break;
+            case 2: row<2>(filterType, filtered, prev, out, length); break;
+            case 3: row<3>(filterType, filtered, prev, out, length); break;
+            case 4: row<4>(filterType, filtered, prev, out, length); break;
+            case 6: row<6>(filterType, filtered, prev, out, length); break;
+            default: row<8>(filterType, filtered, prev, out, length); break;
+        }
+    }
+
+private:
+    template <int BPP>
+    static void row(uint8_t filterType, const uint8_t* filtered, const uint8_t* prev, uint8_t* out, size_t length) {
+        if (filterType == 1) sub<BPP>(filtered, out, length);
+        else if (filterType == 2) up(filtered, prev, out, length);
+        else if (filterType == 3) average<BPP>(filtered, prev, out, length);
+        else if (filterType == 4) paeth<BPP>(filtered, prev, out, length);
+        else std::memcpy(out, filtered, length);
+    }
+
+#ifdef PNG_SSE2
+    // One pixel per step: 4-byte lanes for 3- and 4-byte pixels, 8-byte lanes
+    // for 6- and 8-byte ones. Lanes past the pixel carry junk that the next
+    // step overwrites, so a step needs a full lane of room before the end.
+    template <int BPP>
+    struct Lanes {
+        static const size_t WIDTH = BPP <= 4 ? 4 : 8;
+
+        static __m128i load(const uint8_t* p) {
+            if (WIDTH == 4) {
+                int32_t v;
+                std::memcpy(&v, p, 4);
+                return _mm_cvtsi32_si128(v);
+            }
+            return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+        }
+
+        static void store(uint8_t* p, __m128i v) {
+            if (WIDTH == 4) {
+                int32_t x = _mm_cvtsi128_si32(v);
+                std::memcpy(p, &x, 4);
+            } else {
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(p), v);
+            }
+        }
+    };
+#endif
+
+    template <int BPP>
+    static void sub(const uint8_t* filtered, uint8_t* out, size_t length) {
+        size_t i = 0;
+#ifdef PNG_SSE2
+        if (BPP >= 3) {
+            __m128i a = _mm_setzero_si128();
+            for (; i + Lanes<BPP>::WIDTH <= length; i += BPP) {
+                a = _mm_add_epi8(a, Lanes<BPP>::load(filtered + i));
+                Lanes<BPP>::store(out + i, a);
+            }
+        }
+#endif
+        for (; i < BPP && i < length; i++) out[i] = filtered[i];
+        for (; i < length; i++) out[i] = filtered[i] + out[i - BPP];
+    }
+
+    static void up(const uint8_t* filtered, const uint8_t* prev, uint8_t* out, size_t length) {
+        size_t i = 0;
+#ifdef PNG_SSE2
+        for (; i + 16 <= length; i += 16) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(filtered + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_add_epi8(x, b));
+        }
+#endif
+        for (; i < length; i++) out[i] = filtered[i] + prev[i];
+    }
+
+    template <int BPP>
+    static void average(const uint8_t* filtered, const uint8_t* prev, uint8_t* out, size_t length) {
+        size_t i = 0;
+#ifdef PNG_SSE2
+        if (BPP >= 3) {
+            // _mm_avg_epu8 rounds up; subtracting the low bit of a ^ b
+            // turns that into the floor the filter is defined with.
+            const __m128i one = _mm_set1_epi8(1);
+            __m128i a = _mm_setzero_si128();
+            for (; i + Lanes<BPP>::WIDTH <= length; i += BPP) {
+                __m128i b = Lanes<BPP>::load(prev + i);
+                __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+                a = _mm_add_epi8(Lanes<BPP>::load(filtered + i), avg);
+                Lanes<BPP>::store(out + i, a);
+            }
+        }
+#endif
+        for (; i < BPP && i < length; i++) out[i] = filtered[i] + (prev[i] >> 1);
+        for (; i < length; i++) out[i] = filtered[i] + ((out[i - BPP] + prev[i]) >> 1);
+    }
+
+    template <int BPP>
+    static void paeth(const uint8_t* filtered, const uint8_t* prev, uint8_t* out, size_t length) {
+        size_t i = 0;
+#ifdef PNG_SSE2
+        if (BPP >= 3) {
+            // Predictor arithmetic in 16-bit lanes, choosing branch-free
+            // among a, b and c with the same tie-breaking as the scalar code.
+            const __m128i zero = _mm_setzero_si128();
+            __m128i a = zero, c = zero;
+            for (; i + Lanes<BPP>::WIDTH <= length; i += BPP) {
+                __m128i b = _mm_unpacklo_epi8(Lanes<BPP>::load(prev + i), zero);
+                __m128i pa = _mm_sub_epi16(b, c);
+                __m128i pb = _mm_sub_epi16(a, c);
+                __m128i pc = _mm_add_epi16(pa, pb);
+                pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+                pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+                pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+                __m128i useB = _mm_cmplt_epi16(pb, pa);
+                __m128i pred = _mm_or_si128(_mm_and_si128(useB, b), _mm_andnot_si128(useB, a));
+                __m128i best = _mm_min_epi16(pa, pb);
+                __m128i useC = _mm_cmplt_epi16(pc, best);
+                pred = _mm_or_si128(_mm_and_si128(useC, c), _mm_andnot_si128(useC, pred));
+
+                __m128i x = Lanes<BPP>::load(filtered + i);
+                __m128i result = _mm_add_epi8(x, _mm_packus_epi16(pred, pred));
+                Lanes<BPP>::store(out + i, result);
+                a = _mm_unpacklo_epi8(result, zero);
+                c = b;
+            }
+        }
+#endif
+        for (; i < BPP && i < length; i++) out[i] = filtered[i] + prev[i];
+        for (; i < length; i++) {
+            int a = out[i - BPP], b = prev[i], c = prev[i - BPP];
+            int pa = std::abs(b - c);
+            int pb = std::abs(a - c);
+            int pc = std::abs(a + b - 2 * c);
+            int pred = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+            out[i] = filtered[i] + pred;
+        }
+    }
+};
+
+// Expands 8-bit pixel rows to packed RGB, one loop per layout: gray is
+// broadcast to three channels, alpha is dropped, and palette indices go
+// through a 256-entry table. Where the CPU has SSSE3 (checked once at run
+// time), gray, gray + alpha and RGBA use byte shuffles 16 bytes at a time.
+class RGBExpand {
+public:
+    // Pixels in the given PNG color type other than palette.
+    static void samples(uint8_t colorType, const uint8_t* in, uint8_t* out, size_t pixels) {
+        if (colorType == 0) gray(in, out, pixels);
+        else if (colorType == 2) std::memcpy(out, in, pixels * 3);
+        else if (colorType == 4) grayAlpha(in, out, pixels);
+        else rgba(in, out, pixels);
+    }
+
+    // table holds RGBx words as built by PNGDecoder::paletteTable.
+    static void palette(const uint8_t* in, const uint32_t* table, uint8_t* out, size_t pixels) {
+        if (pixels == 0) return;
+        // Each 4-byte store spills one byte into the next pixel, which
+        // overwrites it; the last pixel is written exactly.
+        for (size_t i = 0; i + 1 < pixels; i++, out += 3) {
+            std::memcpy(out, &table[in[i]], 4);
+        }
+        uint32_t last = table[in[pixels - 1]];
+        out[0] = (uint8_t)last;
+        out[1] = (uint8_t)(last >> 8);
+        out[2] = (uint8_t)(last >> 16);
+    }
+
+private:
+    static void gray(const uint8_t* in, uint8_t* out, size_t pixels) {
+        size_t i = 0;
+#ifdef PNG_SSSE3_DISPATCH
+        if (hasSSSE3()) i = graySSSE3(in, out, pixels);
+#endif
+        for (; i < pixels; i++) {
+            out[3 * i] = out[3 * i + 1] = out[3 * i + 2] = in[i];
+        }
+    }
+
+    static void grayAlpha(const uint8_t* in, uint8_t* out, size_t pixels) {
+        size_t i = 0;
+#ifdef PNG_SSSE3_DISPATCH
+        if (hasSSSE3()) i = grayAlphaSSSE3(in, out, pixels);
+#endif
+        for (; i < pixels; i++) {
+            out[3 * i] = out[3 * i + 1] = out[3 * i + 2] = in[2 * i];
+        }
+    }
+
+    static void rgba(const uint8_t* in, uint8_t* out, size_t pixels) {
+        size_t i = 0;
+#ifdef PNG_SSSE3_DISPATCH
+        if (hasSSSE3()) i = rgbaSSSE3(in, out, pixels);
+#endif
+        for (; i < pixels; i++) {
+            out[3 * i] = in[4 * i];
+            out[3 * i + 1] = in[4 * i + 1];
+            out[3 * i + 2] = in[4 * i + 2];
+        }
+    }
+
+#ifdef PNG_SSSE3_DISPATCH
+    static bool hasSSSE3() {
+        static const bool supported = __builtin_cpu_supports("ssse3");
+        return supported;
+    }
+
+    // The kernels below return how many pixels they handled; the scalar
+    // loops finish the rest. Stores that run past a step's output are
+    // overwritten by the next step, so a step needs 16 bytes of room.
+
+    __attribute__((target("ssse3")))
+    static size_t graySSSE3(const uint8_t* in, uint8_t* out, size_t pixels) {
+        const __m128i m0 = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+        const __m128i m1 = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+        const __m128i m2 = _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+        size_t i = 0;
+        for (; i + 16 <= pixels; i += 16) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            __m128i* dst = reinterpret_cast<__m128i*>(out + 3 * i);
+            _mm_storeu_si128(dst, _mm_shuffle_epi8(x, m0));
+            _mm_storeu_si128(dst + 1, _mm_shuffle_epi8(x, m1));
+            _mm_storeu_si128(dst + 2, _mm_shuffle_epi8(x, m2));
+        }
+        return i;
+    }
+
+    __attribute__((target("ssse3")))
+    static size_t grayAlphaSSSE3(const uint8_t* in, uint8_t* out, size_t pixels) {
+        const __m128i m = _mm_setr_epi8(0, 0, 0, 2, 2, 2, 4, 4, 4, 6, 6, 6, -1, -1, -1, -1);
+        size_t i = 0;
+        for (; i + 6 <= pixels; i += 4) {
+            __m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + 2 * i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 3 * i), _mm_shuffle_epi8(x, m));
+        }
+        return i;
+    }
+
+    __attribute__((target("ssse3")))
+    static size_t rgbaSSSE3(const uint8_t* in, uint8_t* out, size_t pixels) {
+        const __m128i m = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        size_t i = 0;
+        for (; i + 6 <= pixels; i += 4) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 4 * i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 3 * i), _mm_shuffle_epi8(x, m));
+        }
+        return i;
+    }
+#endif
+};
+
+// Interlaced images with at least this many bytes of filtered data are
+// reconstructed on several threads.
+#ifndef ADAM7_PARALLEL_MIN_BYTES
+#define ADAM7_PARALLEL_MIN_BYTES (1u << 20)
+#endif
+
+class PNGDecoder {
+private:
+    // A run of rows whose IDAT data an iDOT chunk marks as an independent
+    // deflate segment.
+    struct IdatSegment {
+        uint32_t firstRow;
+        uint32_t rowCount;
+        std::vector<ByteSpan> input;
+    };
+
+    InputFile fileData;
+    PNGHeader header;
+    std::vector<uint8_t> imageData;
+    std::vector<uint8_t> palette;
+    std::vector<uint8_t> transparency;  // tRNS payload
+    uint32_t decodedRows;
+
+    std::vector<ByteSpan> idatChunks;
+    std::vector<size_t> idatOffsets;
+    const uint8_t* idot;
+    uint32_t idotLength;
+    size_t idotOffset;
+
+public:
+    PNGDecoder() : decodedRows(0), idot(nullptr), idotLength(0), idotOffset(0) {}
+
+    bool load(const std::string& filename) {
+        if (!readFile(filename)) return false;
+        if (!validateSignature()) return false;
+        if (!parseChunks()) return false;
+        if (!decodeImage()) return false;
+
+        return true;
+    }
+
+    // Decodes only rows [firstRow, firstRow + rowCount). With an index built
+    // for this file in indexFile, inflating starts at the last checkpoint at
+    // or before firstRow instead of at the top of the image; otherwise, or if
+    // the index does not match the file, the whole image is decoded and
+    // trimmed. The index is read only once the header is known, so its
+    // stored rows can be checked against the real row length.
+    bool loadRows(const std::string& filename, uint32_t firstRow, uint32_t rowCount, const std::string& indexFile) {
+        if (!readFile(filename)) return false;
+        if (!validateSignature()) return false;
+        if (!parseChunks()) return false;
+        if (rowCount == 0 || firstRow >= header.height || rowCount > header.height - firstRow) return false;
+
+        PNGIndex index;
+        if (!indexFile.empty() && index.load(indexFile, scanlineSize()) &&
+            index.fileSize == fileData.size() && index.fingerprint == fingerprint() &&
+            decodeRows(index, firstRow, rowCount)) {
+            return true;
+        }
+
+        if (!decodeImage()) return false;
+        size_t scanlineBytes = scanlineSize();
+        imageData.erase(imageData.begin() + (firstRow + rowCount) * scanlineBytes, imageData.end());
+        imageData.erase(imageData.begin(), imageData.begin() + firstRow * scanlineBytes);
+        decodedRows = rowCount;
+        return true;
+    }
+
+    // Reads only the signature, IHDR and the 8-byte header of every other
+    // chunk, seeking over chunk data rather than mapping or reading it, so
+    // even huge files can be vetted in microseconds.
+    bool probe(const std::string& filename, PNGInfo& info) {
+        // Unbuffered, so each header costs one small read rather than
+        // refilling a buffer after every seek.
+        std::ifstream file;
+        file.rdbuf()->pubsetbuf(nullptr, 0);
+        file.open(filename, std::ios::binary);
+        if (!file) return false;
+
+        static const uint8_t sig[] = {137, 80, 78, 71, 13, 10, 26, 10};
+        uint8_t bytes[13];
+        if (!file.read(reinterpret_cast<char*>(bytes), 8) || std::memcmp(bytes, sig, 8) != 0) return false;
+
+        bool sawHeader = false;
+        info.idatBytes = 0;
+        info.idatChunks = 0;
+        info.segmented = false;
+        transparency.clear();
+        uint64_t pos = 8;
+        while (file.seekg(pos) && file.read(reinterpret_cast<char*>(bytes), 8)) {
+            uint32_t length = readBE32(bytes);
+            if (std::memcmp(bytes + 4, "IHDR", 4) == 0) {
+                if (length != 13 || !file.read(reinterpret_cast<char*>(bytes), 13)) return false;
+                if (!parseHeader(bytes, length)) return false;
+                sawHeader = true;
+            } else if (std::memcmp(bytes + 4, "IDAT", 4) == 0) {
+                info.idatBytes += length;
+                info.idatChunks++;
+            } else if (std::memcmp(bytes + 4, "iDOT", 4) == 0) {
+                info.segmented = true;
+            } else if (std::memcmp(bytes + 4, "tRNS", 4) == 0) {
+                // Only a color key matters to the estimate, and it is at
+                // most 6 bytes.
+                transparency.resize(std::min<uint32_t>(length, 6));
+                if (!file.read(reinterpret_cast<char*>(transparency.data()), transparency.size())) return false;
+            } else if (std::memcmp(bytes + 4, "IEND", 4) == 0) {
+                break;
+            }
+            pos += 12 + (uint64_t)length;
+        }
+        if (!sawHeader || info.idatChunks == 0) return false;
+
+        info.header = header;
+        info.decodeBytes = decodeMemoryEstimate(info.idatBytes, info.segmented);
+        return true;
+    }
+
+    // Decodes the whole image once, recording a checkpoint at the first
+    // block boundary after every PNGIndex::SPACING bytes of filtered output.
+    bool buildIndex(const std::string& filename, PNGIndex& index) {
+        if (!readFile(filename)) return false;
+        if (!validateSignature()) return false;
+        if (!parseChunks()) return false;
+        if (header.interlaceMethod != 0) return false;
+
+        size_t rowBytes = 1 + scanlineSize();
+        std::vector<uint8_t> filtered;
+        index.points.clear();
+        try {
+            filtered.resize((size_t)header.height * rowBytes);
+            BitReader reader(idatChunks);
+            Deflate::readZlibHeader(reader);
+
+            uint8_t* out = filtered.data();
+            uint8_t* outEnd = out + filtered.size();
+            bool finalBlock = false;
+            uint64_t nextPoint = 0;
+            while (!finalBlock && out != outEnd) {
+                uint64_t outOffset = out - filtered.data();
+                if (outOffset >= nextPoint) {
+                    PNGIndex::Point point;
+                    point.bitOffset = reader.position();
+                    point.outOffset = outOffset;
+                    index.points.push_back(point);
+                    nextPoint = outOffset + PNGIndex::SPACING;
+                }
+                finalBlock = Deflate::inflateBlocks(reader, filtered.data(), out, outEnd, reader.position() + 1);
+            }
+            if (out != outEnd) return false;
+        } catch (...) {
+            return false;
+        }
+        if (!unfilterImageData(filtered.data(), 0, header.height)) return false;
+        decodedRows = header.height;
+
+        size_t scanlineBytes = scanlineSize();
+        for (size_t i = 0; i < index.points.size(); i++) {
+            PNGIndex::Point& point = index.points[i];
+            uint64_t windowStart = point.outOffset - std::min<uint64_t>(point.outOffset, PNGIndex::WINDOW_SIZE);
+            point.window.assign(filtered.begin() + windowStart, filtered.begin() + point.outOffset);
+            uint64_t startRow = (point.outOffset + rowBytes - 1) / rowBytes;
+            if (startRow > 0) {
+                point.prevRow.assign(imageData.begin() + (startRow - 1) * scanlineBytes,
+                                     imageData.begin() + startRow * scanlineBytes);
+            }
+        }
+        index.fileSize = fileData.size();
+        index.fingerprint = fingerprint();
+        return true;
+    }
+
+    std::vector<uint8_t> getRGB() const {
+        std::vector<uint8_t> result;
+        getRGB(result);
+        return result;
+    }
+
+    // Fills rgb with the image as packed 8-bit RGB, sized exactly; alpha
+    // and transparency are dropped. Passing the same buffer for every image
+    // in a batch reuses its allocation. The converter itself reads the rows
+    // in place instead.
+    void getRGB(std::vector<uint8_t>& rgb) const {
+        size_t width = header.width;
+        rgb.resize(width * decodedRows * 3);
+        uint32_t table[256];
+        if (header.colorType == 3) paletteTable(table);
+
+        if (header.bitDepth == 8) {
+            expandRGB(header.colorType, imageData.data(), table, rgb.data(), width * decodedRows);
+            return;
+        }
+        // Other depths are converted to bytes one row at a time first.
+        ByteRows rows(*this);
+        std::vector<uint8_t> row(rows.rowBytes() + ByteRows::SLACK);
+        for (uint32_t y = 0; y < decodedRows; y++) {
+            rows.convert(y, 1, row.data());
+            expandRGB(rows.colorType(), row.data(), table, &rgb[y * width * 3], width);
+        }
+    }
+
+    uint32_t getWidth() const { return header.width; }
+    uint32_t getHeight() const { return decodedRows; }
+
+    // The unfiltered rows in their PNG layout, for encoders that read the
+    // pixels in place.
+    const PNGHeader& getHeader() const { return header; }
+    const uint8_t* getPixels() const { return imageData.data(); }
+    size_t getStride() const { return scanlineSize(); }
+    const std::vector<uint8_t>& getPalette() const { return palette; }
+
+    // For palette images, the tRNS alpha of the leading palette entries;
+    // entries past its end are opaque.
+    const std::vector<uint8_t>& getTransparency() const { return transparency; }
+
+    // The tRNS color key of an 8-bit gray (key[0]) or RGB image. False when
+    // there is none or it is out of range and so matches no pixel.
+    bool getColorKey(uint8_t key[3]) const {
+        uint16_t wide[3];
+        if (header.bitDepth != 8 || !colorKey(wide)) return false;
+        for (uint32_t c = 0; c < samplesPerPixel(); c++) {
+            if (wide[c] > 255) return false;
+            key[c] = (uint8_t)wide[c];
+        }
+        return true;
+    }
+
+    // Rows of an image at a depth other than 8, converted to one byte per
+    // sample a few at a time as they are needed, so the image is never held
+    // at both depths: 16-bit samples are rounded, packed gray is scaled to
+    // 0-255 and packed palette indices are widened. A tRNS color key is
+    // matched at the original depth and becomes an alpha channel.
+    class ByteRows {
+    public:
+        // convert() may write this many bytes past the last row.
+        static const size_t SLACK = 16;
+
+        explicit ByteRows(const PNGDecoder& image)
+            : decoder(image), channels(image.samplesPerPixel()) {
+            keyed = decoder.colorKey(key);
+            if (decoder.header.bitDepth < 8) {
+                buildTable();
+            } else if (keyed) {
+                reduced.resize((size_t)decoder.header.width * channels);
+            }
+        }
+
+        // The PNG color type of the converted rows.
+        uint8_t colorType() const {
+            return keyed ? decoder.header.colorType | 4 : decoder.header.colorType;
+        }
+
+        size_t rowBytes() const {
+            return (size_t)decoder.header.width * (channels + (keyed ? 1 : 0));
+        }
+
+        // Writes rows [firstRow, firstRow + rowCount) to out, rowBytes() apart.
+        void convert(uint32_t firstRow, uint32_t rowCount, uint8_t* out) {
+            size_t width = decoder.header.width;
+            for (uint32_t y = firstRow; y < firstRow + rowCount; y++, out += rowBytes()) {
+                const uint8_t* in = &decoder.imageData[y * decoder.scanlineSize()];
+                if (decoder.header.bitDepth < 8) {
+                    expandPacked(in, out);
+                } else if (keyed) {
+                    reduceKeyed(in, out);
+                } else {
+                    reduceSamples16(in, out, width * channels);
+                }
+            }
+        }
+
+    private:
+        const PNGDecoder& decoder;
+        uint32_t channels;
+        bool keyed;
+        uint16_t key[3];
+        std::vector<uint8_t> reduced;  // one row, for keyed 16-bit images
+        // For packed rows, the converted pixels of each byte value. Entries
+        // are a fixed 16 bytes, so every byte costs one constant-size copy;
+        // copies running past the row are overwritten by the next row or
+        // land in the slack.
+        uint8_t table[256][16];
+
+        void buildTable() {
+            int depth = decoder.header.bitDepth;
+            int maxValue = (1 << depth) - 1;
+            int scale = decoder.header.colorType == 0 ? 255 / maxValue : 1;
+            int outChannels = keyed ? 2 : 1;
+            std::memset(table, 0, sizeof(table));
+            for (int byte = 0; byte < 256; byte++) {
+                for (int k = 0; k < 8 / depth; k++) {
+                    int value = (byte >> (8 - depth * (k + 1))) & maxValue;
+                    uint8_t* out = &table[byte][k * outChannels];
+                    out[0] = (uint8_t)(value * scale);
+                    if (keyed) out[1] = value == key[0] ? 0 : 255;
+                }
+            }
+        }
+
+        void expandPacked(const uint8_t* in, uint8_t* out) const {
+            size_t perByte = 8 / decoder.header.bitDepth;
+            size_t step = perByte * (keyed ? 2 : 1);
+            size_t bytes = (decoder.header.width + perByte - 1) / perByte;
+            for (size_t i = 0; i < bytes; i++, out += step) {
+                std::memcpy(out, table[in[i]], sizeof(table[0]));
+            }
+        }
+
+        void reduceKeyed(const uint8_t* in, uint8_t* out) {
+            size_t width = decoder.header.width;
+            reduceSamples16(in, reduced.data(), width * channels);
+            const uint8_t* samples = reduced.data();
+            for (size_t x = 0; x < width; x++) {
+                bool match = true;
+                for (uint32_t c = 0; c < channels; c++, in += 2) {
+                    *out++ = *samples++;
+                    match = match && ((in[0] << 8) | in[1]) == key[c];
+                }
+                *out++ = match ? 0 : 255;
+            }
+        }
+    };
+
+private:
+    // Palette entries packed as little-endian RGBx words, so a pixel can be
+    // written with one 4-byte store. Indices past the palette map to black.
+    void paletteTable(uint32_t table[256]) const {
+        for (uint32_t i = 0; i < 256; i++) {
+            if (i * 3 + 2 < palette.size()) {
+                table[i] = palette[i * 3] | (palette[i * 3 + 1] << 8) | ((uint32_t)palette[i * 3 + 2] << 16);
+            } else {
+                table[i] = 0;
+            }
+        }
+    }
+
+    static void expandRGB(uint8_t colorType, const uint8_t* in, const uint32_t* table, uint8_t* out,
+                          size_t pixels) {
+        if (colorType == 3) {
+            RGBExpand::palette(in, table, out, pixels);
+        } else {
+            RGBExpand::samples(colorType, in, out, pixels);
+        }
+    }
+
+    // The tRNS color key of a gray or RGB image, at the image's bit depth.
+    bool colorKey(uint16_t key[3]) const {
+        if (header.colorType != 0 && header.colorType != 2) return false;
+        uint32_t channels = samplesPerPixel();
+        if (transparency.size() < channels * 2) return false;
+        for (uint32_t c = 0; c < channels; c++) {
+            key[c] = (transparency[c * 2] << 8) | transparency[c * 2 + 1];
+        }
+        return true;
+    }
+
+    // Converts big-endian 16-bit samples to 8 bits, rounding to nearest:
+    // round(v * 255 / 65535) == (s - (s >> 8)) >> 8 with s = v + 128, where
+    // s saturates at 65535 (which still gives the right answer, 255).
+    static void reduceSamples16(const uint8_t* src, uint8_t* dst, size_t count) {
+        size_t i = 0;
+#ifdef PNG_SSE2
+        const __m128i half = _mm_set1_epi16(128);
+        for (; i + 16 <= count; i += 16) {
+            __m128i reduced[2];
+            for (int k = 0; k < 2; k++) {
+                __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i + 16 * k));
+                __m128i v = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+                __m128i s = _mm_adds_epu16(v, half);
+                reduced[k] = _mm_srli_epi16(_mm_sub_epi16(s, _mm_srli_epi16(s, 8)), 8);
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(reduced[0], reduced[1]));
+        }
+#endif
+        for (; i < count; i++) {
+            uint32_t v = ((uint32_t)src[2 * i] << 8) | src[2 * i + 1];
+            uint32_t s = std::min<uint32_t>(v + 128, 65535);
+            dst[i] = (uint8_t)((s - (s >> 8)) >> 8);
+        }
+    }
+
+    bool readFile(const std::string& filename) {
+        return fileData.open(filename);
+    }
+
+    bool validateSignature() {
+        static const uint8_t sig[] = {137, 80, 78, 71, 13, 10, 26, 10};
+        if (fileData.size() < 8) return false;
+        for (int i = 0; i < 8; i++) {
+            if (fileData[i] != sig[i]) return false;
+        }
+        return true;
+    }
+
+    uint32_t readBE32(size_t pos) const {
+        return readBE32(&fileData[pos]);
+    }
+
+    static uint32_t readBE32(const uint8_t* p) {
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+
+    bool parseHeader(const uint8_t* data, uint32_t length) {
+        if (length != 13) return false;
+        header.width = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+                       ((uint32_t)data[2] << 8) | data[3];
+        header.height = ((uint32_t)data[4] << 24) | ((uint32_t)data[5] << 16) |
+                        ((uint32_t)data[6] << 8) | data[7];
+        header.bitDepth = data[8];
+        header.colorType = data[9];
+        header.compressionMethod = data[10];
+        header.filterMethod = data[11];
+        header.interlaceMethod = data[12];
+        if (header.compressionMethod != 0) return false;
+        if (header.filterMethod != 0) return false;
+        return validFormat();
+    }
+
+    // Walks the chunk list, reading IHDR and PLTE and locating the IDAT
+    // payloads and any iDOT chunk for decodeImage.
+    bool parseChunks() {
+        size_t pos = 8;
+        idatChunks.clear();
+        idatOffsets.clear();
+        idot = nullptr;
+        palette.clear();
+        transparency.clear();
+        bool sawHeader = false;
+
+        while (pos + 12 <= fileData.size()) {
+            size_t chunkStart = pos;
+            uint32_t length = readBE32(pos);
+            pos += 4;
+
+            if (pos + 4 + length + 4 > fileData.size()) break;
+
+            std::string type(reinterpret_cast<const char*>(&fileData[pos]), 4);
+            pos += 4;
+
+            const uint8_t* data = &fileData[pos];
+            pos += length;
+            pos += 4;  // Skip CRC
+
+            if (type == "IHDR") {
+                if (!parseHeader(data, length)) return false;
+                sawHeader = true;
+            } else if (type == "PLTE") {
+                palette.assign(data, data + length);
+            } else if (type == "tRNS") {
+                transparency.assign(data, data + length);
+            } else if (type == "IDAT") {
+                ByteSpan chunk = {data, length};
+                idatChunks.push_back(chunk);
+                idatOffsets.push_back(chunkStart);
+            } else if (type == "iDOT") {
+                idot = data;
+                idotLength = length;
+                idotOffset = chunkStart;
+            } else if (type == "IEND") {
+                break;
+            }
+        }
+
+        return sawHeader && !idatChunks.empty();
+    }
+
+    bool decodeImage() {
+        decodedRows = header.height;
+        try {
+            imageData.clear();
+            imageData.reserve((size_t)header.height * scanlineSize());
+        } catch (...) {
+            return false;
+        }
+
+        std::vector<IdatSegment> segments;
+        if (idot && parseIdot(segments)) {
+            try {
+                if (inflateSegments(segments)) return true;
+            } catch (...) {
+                return false;
+            }
+        }
+        if (header.interlaceMethod > 1) return false;
+
+        try {
+            // The inflater reads the IDAT payloads in place, chunk by chunk.
+            BitReader reader(idatChunks);
+            Deflate::readZlibHeader(reader);
+            if (header.interlaceMethod == 1) return decodeInterlaced(reader);
+
+            if (useParallelInflate(idatSize())) {
+                // The parallel inflate needs the whole filtered image at once.
+                size_t expectedSize = (size_t)header.height * (1 + scanlineSize());
+                std::vector<uint8_t> decompressed(expectedSize);
+                if (ParallelInflate::decompress(idatChunks, reader.position(), decompressed.data(),
+                                                expectedSize, ParallelInflate::threadCount())) {
+                    return unfilterImageData(decompressed.data(), 0, header.height);
+                }
+            }
+
+            InflateStream stream(reader, 1 + scanlineSize());
+            return unfilterStream(stream, 0, header.height);
+        } catch (...) {
+            return false;
+        }
+    }
+
+    // Peak bytes a conversion allocates besides the file itself: the
+    // unfiltered image, eight rows at one byte per sample when it is not 8
+    // bits deep (8-bit images are encoded in place), with the alpha channel
+    // a color key becomes, plus either the inflate window or, when the
+    // stream is inflated in one piece, the filtered image (and for
+    // interlaced images the seven reduced images as well).
+    uint64_t decodeMemoryEstimate(uint64_t idatBytes, bool segmented) const {
+        uint64_t image = (uint64_t)header.height * scanlineSize();
+        uint16_t key[3];
+        uint32_t channels = samplesPerPixel() + (colorKey(key) ? 1 : 0);
+        uint64_t samples = header.bitDepth == 8 ? 0 : 8ull * header.width * channels;
+        uint64_t filtered = image + header.height;
+        uint64_t working;
+        if (header.interlaceMethod == 1) {
+            working = 2 * filtered;
+        } else if (segmented || useParallelInflate(idatBytes)) {
+            working = filtered;
+        } else {
+            working = InflateStream::WINDOW_SIZE + std::max<uint64_t>(4 * (1 + scanlineSize()), 8 * InflateStream::WINDOW_SIZE);
+        }
+        return image + samples + working;
+    }
+
+    static bool useParallelInflate(uint64_t idatBytes) {
+        return idatBytes >= PARALLEL_INFLATE_MIN_BYTES && ParallelInflate::threadCount() >= PARALLEL_INFLATE_MIN_THREADS;
+    }
+
+    uint64_t idatSize() const {
+        uint64_t idatBytes = 0;
+        for (size_t i = 0; i < idatChunks.size(); i++) idatBytes += idatChunks[i].size;
+        return idatBytes;
+    }
+
+    // One of the seven reduced images of an Adam7 interlaced image.
+    struct Adam7Pass {
+        uint32_t width;
+        uint32_t height;
+        size_t scanlineBytes;
+        size_t filteredOffset;
+        size_t reducedOffset;
+    };
+
+    static const uint8_t adam7[7][4];   // x origin, y origin, x step, y step
+    static const uint32_t ADAM7_TILE_WIDTH = 256;
+
+    // Interlaced images store seven reduced images one after another. Each
+    // is unfiltered on its own, then their pixels are scattered into place
+    // one 8-row by 256-pixel tile at a time so each tile's writes stay in
+    // cache. Large images do both steps on several threads.
+    bool decodeInterlaced(BitReader& reader) {
+        Adam7Pass passes[7];
+        size_t filteredSize = 0, reducedSize = 0;
+        for (int p = 0; p < 7; p++) {
+            Adam7Pass& pass = passes[p];
+            pass.width = header.width > adam7[p][0] ? (header.width - adam7[p][0] + adam7[p][2] - 1) / adam7[p][2] : 0;
+            pass.height = header.height > adam7[p][1] ? (header.height - adam7[p][1] + adam7[p][3] - 1) / adam7[p][3] : 0;
+            if (pass.width == 0) pass.height = 0;
+            pass.scanlineBytes = scanlineSize(pass.width);
+            pass.filteredOffset = filteredSize;
+            pass.reducedOffset = reducedSize;
+            filteredSize += pass.height * (1 + pass.scanlineBytes);
+            reducedSize += pass.height * pass.scanlineBytes;
+        }
+
+        std::vector<uint8_t> filtered(filteredSize);
+        if (!useParallelInflate(idatSize()) ||
+            !ParallelInflate::decompress(idatChunks, reader.position(), filtered.data(), filteredSize,
+                                         ParallelInflate::threadCount())) {
+            Deflate::inflate(reader, filtered.data(), filteredSize);
+        }
+
+        unsigned threads = filteredSize >= ADAM7_PARALLEL_MIN_BYTES ? ParallelInflate::threadCount() : 1;
+        std::vector<uint8_t> reduced(reducedSize);
+        uint32_t bpp = bytesPerPixel();
+        ParallelInflate::parallelFor(7, threads, [&](size_t p) {
+            const Adam7Pass& pass = passes[p];
+            if (pass.height == 0) return;
+            std::vector<uint8_t> zeroRow(pass.scanlineBytes);
+            const uint8_t* in = &filtered[pass.filteredOffset];
+            uint8_t* row = &reduced[pass.reducedOffset];
+            const uint8_t* prev = zeroRow.data();
+            for (uint32_t y = 0; y < pass.height; y++) {
+                Unfilter::row(in[0], bpp, in + 1, prev, row, pass.scanlineBytes);
+                in += 1 + pass.scanlineBytes;
+                prev = row;
+                row += pass.scanlineBytes;
+            }
+        });
+
+        // Packed pixels are ORed into place, so the image starts out zeroed.
+        imageData.assign((size_t)header.height * scanlineSize(), 0);
+        size_t bands = (header.height + 7) / 8;
+        ParallelInflate::parallelFor(bands, threads, [&](size_t band) {
+            for (uint32_t x0 = 0; x0 < header.width; x0 += ADAM7_TILE_WIDTH) {
+                uint32_t x1 = std::min<uint32_t>(x0 + ADAM7_TILE_WIDTH, header.width);
+                for (int p = 0; p < 7; p++) {
+                    scatterTile(passes[p], p, &reduced[passes[p].reducedOffset], (uint32_t)band * 8, x0, x1);
+                }
+            }
+        });
+        return true;
+    }
+
+    // Copies the pixels of one pass that fall in rows y0 .. y0 + 7 and
+    // columns x0 .. x1 - 1 of the image, where y0 and x0 are multiples of 8.
+    void scatterTile(const Adam7Pass& pass, int p, const uint8_t* reduced, uint32_t y0, uint32_t x0, uint32_t x1) {
+        if (pass.height == 0 || x0 + adam7[p][0] >= x1) return;
+        size_t scanlineBytes = scanlineSize();
+        uint32_t yEnd = std::min<uint32_t>(y0 + 8, header.height);
+        uint32_t firstX = x0 + adam7[p][0];
+        uint32_t firstColumn = (firstX - adam7[p][0]) / adam7[p][2];
+
+        for (uint32_t y = y0 + adam7[p][1]; y < yEnd; y += adam7[p][3]) {
+            const uint8_t* src = reduced + (size_t)((y - adam7[p][1]) / adam7[p][3]) * pass.scanlineBytes;
+            uint8_t* dst = &imageData[(size_t)y * scanlineBytes];
+            switch (header.bitDepth < 8 ? 0 : bytesPerPixel()) {
+                case 0: scatterPacked(src, firstColumn, dst, firstX, x1, adam7[p][2]); break;
+                case 1: scatterPixels<1>(src, firstColumn, dst, firstX, x1, adam7[p][2]); break;
+                case 2: scatterPixels<2>(src, firstColumn, dst, firstX, x1, adam7[p][2]); break;
+                case 3: scatterPixels<3>(src, firstColumn, dst, firstX, x1, adam7[p][2]); break;
+                case 4: scatterPixels<4>(src, firstColumn, dst, firstX, x1, adam7[p][2]); break;
+                case 6: scatterPixels<6>(src, firstColumn, dst, firstX, x1, adam7[p][2]); break;
+                default: scatterPixels<8>(src, firstColumn, dst, firstX, x1, adam7[p][2]); break;
+            }
+        }
+    }
+
+    template <int BPP>
+    static void scatterPixels(const uint8_t* src, uint32_t column, uint8_t* dst, uint32_t x, uint32_t xEnd,
+                              uint32_t step) {
+        for (; x < xEnd; x += step, column++) {
+            std::memcpy(dst + (size_t)x * BPP, src + (size_t)column * BPP, BPP);
+        }
+    }
+
+    void scatterPacked(const uint8_t* src, uint32_t column, uint8_t* dst, uint32_t x, uint32_t xEnd,
+                       uint32_t step) const {
+        uint32_t depth = header.bitDepth;
+        uint32_t mask = (1u << depth) - 1;
+        for (; x < xEnd; x += step, column++) {
+            uint32_t srcBit = column * depth, dstBit = x * depth;
+            uint32_t value = (src[srcBit / 8] >> (8 - depth - srcBit % 8)) & mask;
+            dst[dstBit / 8] |= (uint8_t)(value << (8 - depth - dstBit % 8));
+        }
+    }
+
+    // Resumes inflating at the last index point whose first whole row is at
+    // or before firstRow, and unfilters from there, seeded with the stored
+    // row above. Returns false if the index does not fit the stream.
+    bool decodeRows(const PNGIndex& index, uint32_t firstRow, uint32_t rowCount) {
+        if (header.interlaceMethod != 0) return false;
+        size_t rowBytes = 1 + scanlineSize();
+        size_t scanlineBytes = scanlineSize();
+        uint64_t imageBytes = (uint64_t)header.height * rowBytes;
+
+        const PNGIndex::Point* point = nullptr;
+        for (size_t i = 0; i < index.points.size(); i++) {
+            const PNGIndex::Point& p = index.points[i];
+            if (p.outOffset > imageBytes || (p.outOffset + rowBytes - 1) / rowBytes > firstRow) break;
+            point = &p;
+        }
+        if (!point) return false;
+
+        uint64_t startRow = (point->outOffset + rowBytes - 1) / rowBytes;
+        if (point->window.size() != std::min<uint64_t>(point->outOffset, PNGIndex::WINDOW_SIZE)) return false;
+        if (point->prevRow.size() != (startRow > 0 ? scanlineBytes : 0)) return false;
+
+        try {
+            BitReader reader(idatChunks);
+            reader.seek(point->bitOffset);
+            InflateStream stream(reader, rowBytes, point->window);
+            if (startRow * rowBytes > point->outOffset) stream.next(startRow * rowBytes - point->outOffset);
+
+            // The stored row stands in for the one above startRow, so rows
+            // are unfiltered relative to it and it is dropped afterwards.
+            uint32_t seedRows = startRow > 0 ? 1 : 0;
+            uint32_t streamRows = (uint32_t)(firstRow + rowCount - startRow);
+            imageData = point->prevRow;
+            imageData.reserve((size_t)(seedRows + streamRows) * scanlineBytes);
+            if (!unfilterStream(stream, seedRows, streamRows)) return false;
+            imageData.erase(imageData.begin(), imageData.begin() + (seedRows + firstRow - startRow) * scanlineBytes);
+        } catch (...) {
+            return false;
+        }
+        decodedRows = rowCount;
+        return true;
+    }
+
+    // Inflates and unfilters rows one at a time, so each row is still in
+    // cache when it is reconstructed and the filtered image is never held.
+    bool unfilterStream(InflateStream& stream, uint32_t firstRow, uint32_t rowCount) {
+        size_t rowBytes = 1 + scanlineSize();
+        for (uint32_t y = firstRow; y < firstRow + rowCount; y++) {
+            if (!unfilterImageData(stream.next(rowBytes), y, 1)) return false;
+        }
+        return true;
+    }
+
+    // FNV-1a over the IHDR data and the CRCs of the IDAT chunks, which is
+    // enough to tell whether an index was built for this file.
+    uint64_t fingerprint() const {
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&hash](const uint8_t* p, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                hash ^= p[i];
+                hash *= 1099511628211ull;
+            }
+        };
+        if (fileData.size() >= 8 + 8 + 13) mix(&fileData[16], 13);
+        for (size_t i = 0; i < idatChunks.size(); i++) {
+            mix(idatChunks[i].data + idatChunks[i].size, 4);
+        }
+        return hash;
+    }
+
+    // Splits the IDAT stream along the segments listed in an iDOT chunk, as
+    // written by Apple's encoder: a segment count followed by (first row,
+    // row count, offset) triples, where the offset locates the segment's
+    // first IDAT chunk relative to the start of the iDOT chunk. Each segment
+    // ends with a full flush, so it can be inflated on its own.
+    bool parseIdot(std::vector<IdatSegment>& segments) const {
+        if (header.interlaceMethod != 0 || idotLength < 4) return false;
+        uint32_t count = readBE32(idot);
+        if (count < 2 || idotLength != 4 + 12 * (uint64_t)count) return false;
+
+        std::vector<size_t> firstChunk;
+        size_t chunkIndex = 0;
+        uint32_t nextRow = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            const uint8_t* entry = idot + 4 + 12 * i;
+            uint32_t firstRow = readBE32(entry);
+            uint32_t rowCount = readBE32(entry + 4);
+            size_t offset = idotOffset + readBE32(entry + 8);
+            if (firstRow != nextRow || rowCount == 0 || rowCount > header.height - firstRow) return false;
+            nextRow += rowCount;
+
+            while (chunkIndex < idatOffsets.size() && idatOffsets[chunkIndex] < offset) chunkIndex++;
+            if (chunkIndex == idatOffsets.size() || idatOffsets[chunkIndex] != offset) return false;
+            if (i == 0 && chunkIndex != 0) return false;
+
+            IdatSegment segment = {firstRow, rowCount, std::vector<ByteSpan>()};
+            segments.push_back(segment);
+            firstChunk.push_back(chunkIndex++);
+        }
+        if (nextRow != header.height) return false;
+
+        firstChunk.push_back(idatChunks.size());
+        for (uint32_t i = 0; i < count; i++) {
+            segments[i].input.assign(idatChunks.begin() + firstChunk[i], idatChunks.begin() + firstChunk[i + 1]);
+        }
+        return true;
+    }
+
+    // Inflates iDOT segments on worker threads while this thread unfilters
+    // them in order, each one as soon as it has been inflated and the rows
+    // before it are done. Returns false if any segment fails to decode, in
+    // which case the caller falls back to inflating the stream serially.
+    bool inflateSegments(const std::vector<IdatSegment>& segments) {
+        size_t rowBytes = 1 + scanlineSize();
+        std::vector<uint8_t> filtered;
+        try {
+            filtered.resize((size_t)header.height * rowBytes);
+        } catch (...) {
+            return false;
+        }
+
+        size_t count = segments.size();
+        std::vector<int> state(count, 0);      // 0 = pending, 1 = inflated, -1 = failed
+        std::mutex mutex;
+        std::condition_variable inflated;
+        std::atomic<size_t> nextSegment(1);
+
+        auto inflateSegment = [&](size_t i) {
+            bool ok = true;
+            try {
+                BitReader reader(segments[i].input);
+                if (i == 0) Deflate::readZlibHeader(reader);
+                Deflate::inflate(reader, &filtered[segments[i].firstRow * rowBytes],
+                                 segments[i].rowCount * rowBytes);
+            } catch (...) {
+                ok = false;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            state[i] = ok ? 1 : -1;
+            inflated.notify_all();
+        };
+
+        unsigned threads = ParallelInflate::threadCount();
+        size_t workerCount = std::min<size_t>(count - 1, threads > 1 ? threads - 1 : 0);
+        std::vector<std::thread> workers;
+        workers.reserve(workerCount);
+        try {
+            for (size_t w = 0; w < workerCount; w++) {
+                workers.emplace_back([&]() {
+                    for (size_t i = nextSegment++; i < count; i = nextSegment++) {
+                        inflateSegment(i);
+                    }
+                });
+            }
+        } catch (...) {
+            // Out of threads: this thread inflates whatever is left.
+        }
+
+        // Anything thrown here must wait until the workers are joined, or
+        // their std::thread objects would be destroyed while still running.
+        bool ok = true;
+        std::exception_ptr error;
+        try {
+            for (size_t i = 0; i < count && ok; i++) {
+                if (i == 0 || workers.empty()) inflateSegment(i);
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    inflated.wait(lock, [&]() { return state[i] != 0; });
+                    ok = state[i] == 1;
+                }
+                if (ok) {
+                    ok = unfilterImageData(&filtered[segments[i].firstRow * rowBytes],
+                                           segments[i].firstRow, segments[i].rowCount);
+                }
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        nextSegment = count;
+        for (size_t w = 0; w < workers.size(); w++) {
+            workers[w].join();
+        }
+        if (error) std::rethrow_exception(error);
+        return ok;
+    }
+
+    // The bit depths each color type allows; anything else would send the
+    // sample and table arithmetic out of range.
+    bool validFormat() const {
+        if (header.width == 0 || header.height == 0) return false;
+        int depth = header.bitDepth;
+        switch (header.colorType) {
+            case 0: return depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16;
+            case 3: return depth == 1 || depth == 2 || depth == 4 || depth == 8;
+            case 2: case 4: case 6: return depth == 8 || depth == 16;
+            default: return false;
+        }
+    }
+
+    uint32_t samplesPerPixel() const {
+        if (header.colorType == 2) return 3;
+        if (header.colorType == 4) return 2;
+        if (header.colorType == 6) return 4;
+        return 1;
+    }
+
+    size_t scanlineSize() const {
+        return scanlineSize(header.width);
+    }
+
+    size_t scanlineSize(uint32_t width) const {
+        return ((uint64_t)width * samplesPerPixel() * header.bitDepth + 7) / 8;
+    }
+
+    // The byte distance the filters use for the pixel to the left; pixels
+    // smaller than a byte count as one byte.
+    uint32_t bytesPerPixel() const {
+        return std::max<uint32_t>(1, samplesPerPixel() * header.bitDepth / 8);
+    }
+
+    // Reconstructs rowCount rows starting at firstRow from their filtered
+    // bytes. Rows must be unfiltered in order, since each one is predicted
+    // from the row above it.
+    bool unfilterImageData(const uint8_t* filtered, uint32_t firstRow, uint32_t rowCount) {
+        uint32_t bpp = bytesPerPixel();
+        size_t scanlineBytes = scanlineSize();
+
+        if (firstRow == 0) imageData.clear();
+        if (imageData.size() != firstRow * scanlineBytes) return false;
+
+        // Rows are rebuilt in place at the end of imageData, reading the row
+        // above from just before them; callers reserve the whole image up
+        // front so this never reallocates.
+        std::vector<uint8_t> zeroRow;
+        if (firstRow == 0) zeroRow.resize(scanlineBytes);
+        imageData.resize(imageData.size() + (size_t)rowCount * scanlineBytes);
+
+        size_t pos = 0;
+        for (uint32_t y = firstRow; y < firstRow + rowCount; y++) {
+            uint8_t filterType = filtered[pos++];
+            uint8_t* row = &imageData[(size_t)y * scanlineBytes];
+            const uint8_t* prev = y > 0 ? row - scanlineBytes : zeroRow.data();
+
+            Unfilter::row(filterType, bpp, filtered + pos, prev, row, scanlineBytes);
+            pos += scanlineBytes;
+        }
+
+        return true;
+    }
+};
+
+const uint8_t PNGDecoder::adam7[7][4] = {
+    {0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4}, {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}
+};
+
+// ============= JPEG ENCODER =============
+
+// RGB to YCbCr, level shifted by -128.
+static inline void rgbToYCbCr(float r, float g, float b, float& y, float& cb, float& cr) {
+    y  =  0.299f * r + 0.587f * g + 0.114f * b - 128.0f;
+    cb = -0.168736f * r - 0.331264f * g + 0.5f * b;
+    cr =  0.5f * r - 0.418688f * g - 0.081312f * b;
+}
+
+// The same conversion in libjpeg's 16-bit fixed point, for the integer
+// DCTs. Being integer arithmetic throughout, it gives the same samples
+// whatever the compiler does with floating-point contraction or ordering.
+static inline void rgbToYCbCr(int r, int g, int b, int16_t& y, int16_t& cb, int16_t& cr) {
+    y  = (int16_t)(((19595 * r + 38470 * g + 7471 * b + 32768) >> 16) - 128);
+    cb = (int16_t)((-11059 * r - 21709 * g + 32768 * b + 32767) >> 16);
+    cr = (int16_t)((32768 * r - 27439 * g - 5329 * b + 32767) >> 16);
+}
+
+// Compositing a sample onto the background computes c * a + bg * (255 - a),
+// then divides by 255 with rounding. The division is exact for every 8-bit
+// input, so opaque pixels keep their color.
+static inline int divide255(int t) {
+    t += 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+#ifdef PNG_SSE2
+static inline __m128i divide255(__m128i t) {
+    t = _mm_add_epi16(t, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+#endif
+
+// Pixel sources let the encoder read an image in the layout it was decoded
+// to instead of from an RGB copy. row() returns the YCbCr of up to 8 pixels
+// of one row, as float for the float DCT or as int16_t in fixed point for
+// the integer ones; the encoder is instantiated per source, so the layout
+// is fixed at compile time and the lookup inlines into the block loop. Rows
+// are stride bytes apart. grayscale() is true when every pixel of a width x
+// height image comes out gray, so it can be encoded as luma only.
+
+// True when every pixel of the RGB or RGBA rows has R == G == B. Runs of
+// pixels are compared 16 bytes at a time against the same bytes shifted by
+// one; a color image usually fails within its first few pixels.
+template <int Channels>
+static bool achromaticRows(const uint8_t* data, size_t stride, uint32_t width, uint32_t height) {
+    size_t bytes = (size_t)width * Channels;
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t* p = data + y * stride;
+        size_t i = 0;
+#ifdef PNG_SSE2
+        // Each byte must equal the next one, except a pixel's last color
+        // byte; for RGB that pattern repeats every 48 bytes. The loads stay
+        // one byte short of the row end.
+        if (Channels == 3) {
+            for (; i + 49 <= bytes; i += 48) {
+                int m0 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)),
+                                                          _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 1))));
+                int m1 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 16)),
+                                                          _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 17))));
+                int m2 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 32)),
+                                                          _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 33))));
+                if ((m0 & 0xB6DB) != 0xB6DB || (m1 & 0xDB6D) != 0xDB6D || (m2 & 0x6DB6) != 0x6DB6) return false;
+            }
+        } else {
+            for (; i + 17 <= bytes; i += 16) {
+                int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)),
+                                                         _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 1))));
+                if ((m & 0x3333) != 0x3333) return false;
+            }
+        }
+#endif
+        for (; i < bytes; i += Channels) {
+            if (p[i] != p[i + 1] || p[i + 1] != p[i + 2]) return false;
+        }
+    }
+    return true;
+}
+
+template <int Channels>
+struct InterleavedPixels {
+    const uint8_t* data;
+    size_t stride;
+
+    InterleavedPixels(const uint8_t* pixels, size_t rowBytes) : data(pixels), stride(rowBytes) {}
+
+    bool grayscale(uint32_t width, uint32_t height) const {
+        return Channels == 1 || achromaticRows<Channels>(data, stride, width, height);
+    }
+
+    template <typename Sample>
+    void row(uint32_t x, uint32_t y, uint32_t count, Sample* luma, Sample* cb, Sample* cr) const {
+        const uint8_t* p = data + y * stride + (size_t)x * Channels;
+        for (uint32_t i = 0; i < count; i++, p += Channels) {
+            if (Channels >= 3) {
+                rgbToYCbCr(p[0], p[1], p[2], luma[i], cb[i], cr[i]);
+            } else {
+                rgbToYCbCr(p[0], p[0], p[0], luma[i], cb[i], cr[i]);
+            }
+        }
+    }
+};
+
+typedef InterleavedPixels<1> GrayPixels;
+typedef InterleavedPixels<3> RGBPixels;
+
+// Gray or RGB with a tRNS color key: pixels equal to the key are fully
+// transparent and take the background color.
+template <int Channels>
+struct KeyedPixels {
+    const uint8_t* data;
+    size_t stride;
+    uint8_t key[3];
+    uint8_t fill[3];
+    bool grayFill;
+
+    KeyedPixels(const uint8_t* pixels, size_t rowBytes, const uint8_t colorKey[3], const uint8_t background[3])
+        : data(pixels), stride(rowBytes) {
+        std::memcpy(key, colorKey, Channels);
+        std::memcpy(fill, background, 3);
+        grayFill = background[0] == background[1] && background[1] == background[2];
+    }
+
+    bool grayscale(uint32_t width, uint32_t height) const {
+        return grayFill && (Channels == 1 || achromaticRows<Channels>(data, stride, width, height));
+    }
+
+    template <typename Sample>
+    void row(uint32_t x, uint32_t y, uint32_t count, Sample* luma, Sample* cb, Sample* cr) const {
+        const uint8_t* p = data + y * stride + (size_t)x * Channels;
+        for (uint32_t i = 0; i < count; i++, p += Channels) {
+            bool transparent = p[0] == key[0] && (Channels == 1 || (p[1] == key[1] && p[2] == key[2]));
+            if (transparent) {
+                rgbToYCbCr(fill[0], fill[1], fill[2], luma[i], cb[i], cr[i]);
+            } else if (Channels >= 3) {
+                rgbToYCbCr(p[0], p[1], p[2], luma[i], cb[i], cr[i]);
+            } else {
+                rgbToYCbCr(p[0], p[0], p[0], luma[i], cb[i], cr[i]);
+            }
+        }
+    }
+};
+
+// Gray + alpha or RGBA, composited onto the background as it is read. Full
+// runs of 8 pixels are blended together in 16-bit SSE2 lanes.
+template <int Channels>
+struct AlphaPixels {
+    const uint8_t* data;
+    size_t stride;
+    uint8_t background[3];
+
+    AlphaPixels(const uint8_t* pixels, size_t rowBytes, const uint8_t color[3])
+        : data(pixels), stride(rowBytes) {
+        std::memcpy(background, color, 3);
+    }
+
+    // Gray pixels composited onto a gray background stay gray.
+    bool grayscale(uint32_t width, uint32_t height) const {
+        if (background[0] != background[1] || background[1] != background[2]) return false;
+        return Channels == 2 || achromaticRows<Channels>(data, stride, width, height);
+    }
+
+    template <typename Sample>
+    void row(uint32_t x, uint32_t y, uint32_t count, Sample* luma, Sample* cb, Sample* cr) const {
+        const uint8_t* p = data + y * stride + (size_t)x * Channels;
+        uint8_t rgbx[8 * 4];
+#ifdef PNG_SSE2
+        if (count == 8) {
+            composite8(p, rgbx);
+        } else
+#endif
+        {
+            for (uint32_t i = 0; i < count; i++, p += Channels) {
+                int alpha = p[Channels - 1];
+                for (int c = 0; c < 3; c++) {
+                    int sample = p[Channels == 4 ? c : 0];
+                    rgbx[i * 4 + c] = (uint8_t)divide255(sample * alpha + background[c] * (255 - alpha));
+                }
+            }
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            rgbToYCbCr(rgbx[i * 4], rgbx[i * 4 + 1], rgbx[i * 4 + 2], luma[i], cb[i], cr[i]);
+        }
+    }
 
-            if (pos + 4 + length + 4 > fileData.size()) break;
+#ifdef PNG_SSE2
+    // Blends 8 pixels into rgbx as RGB plus a padding byte.
+    void composite8(const uint8_t* p, uint8_t* rgbx) const {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i opaque = _mm_set1_epi16(255);
+        if (Channels == 4) {
+            const __m128i bg = _mm_setr_epi16(background[0], background[1], background[2], 0,
+                                              background[0], background[1], background[2], 0);
+            for (int half = 0; half < 2; half++) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + half * 16));
+                __m128i pixels[2] = {_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero)};
+                for (int k = 0; k < 2; k++) {
+                    __m128i alpha = _mm_shufflelo_epi16(pixels[k], _MM_SHUFFLE(3, 3, 3, 3));
+                    alpha = _mm_shufflehi_epi16(alpha, _MM_SHUFFLE(3, 3, 3, 3));
+                    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(pixels[k], alpha),
+                                                _mm_mullo_epi16(bg, _mm_sub_epi16(opaque, alpha)));
+                    pixels[k] = divide255(sum);
+                }
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(rgbx + half * 16), _mm_packus_epi16(pixels[0], pixels[1]));
+            }
+        } else {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i gray = _mm_and_si128(v, _mm_set1_epi16(0xFF));
+            __m128i alpha = _mm_srli_epi16(v, 8);
+            __m128i weighted = _mm_mullo_epi16(gray, alpha);
+            __m128i inverse = _mm_sub_epi16(opaque, alpha);
+            __m128i r = divide255(_mm_add_epi16(weighted, _mm_mullo_epi16(_mm_set1_epi16(background[0]), inverse)));
+            __m128i g = divide255(_mm_add_epi16(weighted, _mm_mullo_epi16(_mm_set1_epi16(background[1]), inverse)));
+            __m128i b = divide255(_mm_add_epi16(weighted, _mm_mullo_epi16(_mm_set1_epi16(background[2]), inverse)));
+            // Interleave the three planes into RGBx
+            __m128i rb = _mm_packus_epi16(r, b);
+            __m128i g0 = _mm_packus_epi16(g, zero);
+            __m128i rg = _mm_unpacklo_epi8(rb, g0);
+            __m128i b0 = _mm_unpackhi_epi8(rb, g0);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(rgbx), _mm_unpacklo_epi16(rg, b0));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(rgbx + 16), _mm_unpackhi_epi16(rg, b0));
+        }
+    }
+#endif
+};
 
-            std::string type(reinterpret_cast<char*>(&fileData[pos]), 4);
-            pos += 4;
+typedef AlphaPixels<2> GrayAlphaPixels;
+typedef AlphaPixels<4> RGBAPixels;
 
-            uint8_t* data = &fileData[pos];
-            pos += length;
-            pos += 4;  // Skip CRC
+// One index byte per pixel. The palette is composited with its tRNS alpha
+// and converted to YCbCr once, in both sample types, so each pixel is a
+// single table lookup. Indices past the palette map to black.
+struct PalettePixels {
+    const uint8_t* data;
+    size_t stride;
+    float colors[256][3];
+    int16_t fixedColors[256][3];
+    bool grayPalette;
 
-            if (type == "IHDR") {
-                if (length != 13) return false;
-                header.width = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
-                               ((uint32_t)data[2] << 8) | data[3];
-                header.height = ((uint32_t)data[4] << 24) | ((uint32_t)data[5] << 16) |
-                                ((uint32_t)data[6] << 8) | data[7];
-                header.bitDepth = data[8];
-                header.colorType = data[9];
-                header.compressionMethod = data[10];
-                header.filterMethod = data[11];
-                header.interlaceMethod = data[12];
-                if (header.compressionMethod != 0) return false;
-                if (header.filterMethod != 0) return false;
-            } else if (type == "PLTE") {
-                palette.assign(data, data + length);
-            } else if (type == "IDAT") {
-                compressedData.insert(compressedData.end(), data, data + length);
-            } else if (type == "IEND") {
-                break;
+    PalettePixels(const uint8_t* pixels, size_t rowBytes, const std::vector<uint8_t>& palette,
+                  const std::vector<uint8_t>& alpha, const uint8_t background[3])
+        : data(pixels), stride(rowBytes), grayPalette(true) {
+        for (size_t i = 0; i < 256; i++) {
+            const uint8_t black[3] = {0, 0, 0};
+            const uint8_t* entry = i * 3 + 2 < palette.size() ? &palette[i * 3] : black;
+            int a = i < alpha.size() ? alpha[i] : 255;
+            int rgb[3];
+            for (int c = 0; c < 3; c++) {
+                rgb[c] = divide255(entry[c] * a + background[c] * (255 - a));
             }
+            rgbToYCbCr(rgb[0], rgb[1], rgb[2], colors[i][0], colors[i][1], colors[i][2]);
+            rgbToYCbCr(rgb[0], rgb[1], rgb[2], fixedColors[i][0], fixedColors[i][1], fixedColors[i][2]);
+            grayPalette = grayPalette && rgb[0] == rgb[1] && rgb[1] == rgb[2];
         }
+    }
 
-        if (compressedData.size() < 6) return false;
+    bool grayscale(uint32_t, uint32_t) const { return grayPalette; }
 
-        try {
-            std::vector<uint8_t> deflateData(compressedData.begin() + 2, compressedData.end() - 4);
-            std::vector<uint8_t> decompressed = Deflate::decompress(deflateData);
-            return unfilterImageData(decompressed);
-        } catch (...) {
-            return false;
+    template <typename Sample>
+    void row(uint32_t x, uint32_t y, uint32_t count, Sample* luma, Sample* cb, Sample* cr) const {
+        const uint8_t* p = data + y * stride + x;
+        for (uint32_t i = 0; i < count; i++) {
+            const Sample* c = color(p[i], luma);
+            luma[i] = c[0];
+            cb[i] = c[1];
+            cr[i] = c[2];
         }
     }
 
-    bool unfilterImageData(const std::vector<uint8_t>& filtered) {
-        uint32_t bytesPerPixel = 1;
-        if (header.colorType == 2) bytesPerPixel = 3;
-        else if (header.colorType == 3) bytesPerPixel = 1;
-        else if (header.colorType == 4) bytesPerPixel = 2;
-        else if (header.colorType == 6) bytesPerPixel = 4;
+    const float* color(uint8_t index, const float*) const { return colors[index]; }
+    const int16_t* color(uint8_t index, const int16_t*) const { return fixedColors[index]; }
+};
 
-        uint32_t scanlineBytes = (header.width * bytesPerPixel * header.bitDepth + 7) / 8;
-        
-        size_t expectedSize = (size_t)header.height * (1 + scanlineBytes);
-        if (filtered.size() < expectedSize) {
-            return false;
+// Rows produced on demand, for images that have to be converted before
+// pixels can read them. They are converted a band at a time into a buffer
+// of BAND_ROWS rows, which pixels reads, just before the encoder extracts
+// blocks from them; Rows::convert(firstRow, rowCount, out) writes a band.
+// Bands line up with the encoder's block rows, so each is converted once.
+static const uint32_t BAND_ROWS = 8;
+
+template <typename Source, typename Rows>
+struct BandedPixels {
+    Source pixels;
+    Rows* rows;
+    uint8_t* band;
+    uint32_t height;
+    bool scan;  // pixels.grayscale() has to look at the samples
+    mutable uint32_t bandStart, bandEnd;
+
+    BandedPixels(const Source& source, Rows& bandRows, uint8_t* buffer, uint32_t imageHeight, bool scanRows)
+        : pixels(source), rows(&bandRows), band(buffer), height(imageHeight), scan(scanRows),
+          bandStart(0), bandEnd(0) {}
+
+    // Sources that do not look at the samples decide from zero rows.
+    bool grayscale(uint32_t width, uint32_t) const {
+        if (!pixels.grayscale(width, 0)) return false;
+        if (!scan) return true;
+        for (uint32_t y = 0; y < height; y += BAND_ROWS) {
+            load(y);
+            if (!pixels.grayscale(width, bandEnd - bandStart)) return false;
         }
-        
-        imageData.clear();
-        imageData.reserve(header.height * scanlineBytes);
+        return true;
+    }
 
-        size_t pos = 0;
-        for (uint32_t y = 0; y < header.height; y++) {
-            if (pos >= filtered.size()) return false;
-            uint8_t filterType = filtered[pos++];
-            std::vector<uint8_t> scanline(scanlineBytes);
+    template <typename Sample>
+    void row(uint32_t x, uint32_t y, uint32_t count, Sample* luma, Sample* cb, Sample* cr) const {
+        if (y < bandStart || y >= bandEnd) load(y - y % BAND_ROWS);
+        pixels.row(x, y - bandStart, count, luma, cb, cr);
+    }
 
-            for (uint32_t x = 0; x < scanlineBytes; x++) {
-                if (pos >= filtered.size()) return false;
-                uint8_t byte = filtered[pos++];
-                uint8_t a = 0, b = 0, c = 0;
+    void load(uint32_t y) const {
+        bandStart = y;
+        bandEnd = std::min(y + BAND_ROWS, height);
+        rows->convert(bandStart, bandEnd - bandStart, band);
+    }
+};
 
-                if (x >= bytesPerPixel) {
-                    a = scanline[x - bytesPerPixel];
-                }
-                if (y > 0) {
-                    b = imageData[(y - 1) * scanlineBytes + x];
-                }
-                if (x >= bytesPerPixel && y > 0) {
-                    c = imageData[(y - 1) * scanlineBytes + x - bytesPerPixel];
-                }
+template <typename Source, typename Rows>
+static BandedPixels<Source, Rows> bandedPixels(const Source& pixels, Rows& rows, uint8_t* band,
+                                               uint32_t height, bool scan) {
+    return BandedPixels<Source, Rows>(pixels, rows, band, height, scan);
+}
 
-                uint8_t result = byte;
-                if (filterType == 1) {
-                    result = byte + a;
-                } else if (filterType == 2) {
-                    result = byte + b;
-                } else if (filterType == 3) {
-                    result = byte + ((a + b) / 2);
-                } else if (filterType == 4) {
-                    int p = a + b - c;
-                    int pa = std::abs(p - a);
-                    int pb = std::abs(p - b);
-                    int pc = std::abs(p - c);
-                    if (pa <= pb && pa <= pc) result = byte + a;
-                    else if (pb <= pc) result = byte + b;
-                    else result = byte + c;
-                }
+enum class PixelFormat { GRAY, GRAY_ALPHA, RGB, RGBA };
 
-                scanline[x] = result;
-            }
+// Forward DCT engines. FLOAT is the AAN algorithm in single precision.
+// ISLOW and IFAST are the fixed-point accurate and fast variants used by
+// libjpeg, fed by its fixed-point color conversion, so from pixels to
+// coefficients their output depends on nothing but integer arithmetic.
+enum class DCTMethod { FLOAT, ISLOW, IFAST };
+
+// Pixels the caller owns, 8 bits per sample, with rows stride bytes apart:
+// a decoder's buffer, a memory-mapped frame or a region of a larger image.
+// Nothing is copied, so the pixels must outlive every use of the view.
+struct ImageView {
+    const uint8_t* data;
+    uint32_t width, height;
+    size_t stride;
+    PixelFormat format;
+
+    ImageView(const uint8_t* pixels, uint32_t w, uint32_t h, size_t rowBytes, PixelFormat pixelFormat)
+        : data(pixels), width(w), height(h), stride(rowBytes), format(pixelFormat) {}
 
-            imageData.insert(imageData.end(), scanline.begin(), scanline.end());
+    uint32_t bytesPerPixel() const {
+        switch (format) {
+            case PixelFormat::GRAY: return 1;
+            case PixelFormat::GRAY_ALPHA: return 2;
+            case PixelFormat::RGB: return 3;
+            default: return 4;
         }
+    }
 
-        return true;
+    // The w x h region at (x, y), which must lie inside the view.
+    ImageView crop(uint32_t x, uint32_t y, uint32_t w, uint32_t h) const {
+        return ImageView(data + y * stride + (size_t)x * bytesPerPixel(), w, h, stride, format);
     }
 };
 
-// ============= JPEG ENCODER =============
-
 class JPEGEncoder {
 private:
-    std::vector<uint8_t> rgb;
+    ImageView view;
     uint32_t width, height;
     int quality;
+    int components;             // 1 for grayscale, 3 for YCbCr
+    uint8_t background[3];      // what alpha in the view is composited onto
+    DCTMethod dctMethod;
     
     // Bit buffer for entropy coding
     uint32_t bitBuf;
@@ -465,6 +2854,24 @@ private:
     int YTable[64];
     int CbCrTable[64];
     
+    // Quantizer divisors for ISLOW and IFAST, in libjpeg-turbo's form:
+    // dividing by d with rounding is adding correction, multiplying by
+    // reciprocal and shifting right by shift, all in unsigned 32 bits.
+    // scale is 2^(32 - shift), for doing that shift as a second 16-bit
+    // multiply-high, which needs shift > 16.
+    struct Divisors {
+        uint16_t reciprocal[64];
+        uint16_t correction[64];
+        uint16_t scale[64];
+        uint8_t shift[64];
+        bool wide;              // every shift is over 16
+    };
+    
+    // Quantizer divisors with the output scale of the selected DCT folded
+    // in: reciprocals for FLOAT, the integer form for ISLOW and IFAST
+    float YReciprocals[64], CbCrReciprocals[64];
+    Divisors YDivisors, CbCrDivisors;
+    
     // Huffman code/size tables
     uint16_t YDC_HT[12][2];   // [symbol][code, size]
     uint16_t UVDC_HT[12][2];
@@ -475,6 +2882,7 @@ private:
     static const uint8_t std_luminance_quant[64];
     static const uint8_t std_chrominance_quant[64];
     static const uint8_t zigzag[64];
+    static const float aanScale[8];
     
     // Standard Huffman tables
     static const uint8_t std_dc_luminance_nrcodes[17];
@@ -487,17 +2895,57 @@ private:
     static const uint8_t std_ac_chrominance_values[162];
 
 public:
-    JPEGEncoder(const std::vector<uint8_t>& rgb_data, uint32_t w, uint32_t h, int q)
-        : rgb(rgb_data), width(w), height(h), quality(std::max(1, std::min(100, q))),
-          bitBuf(0), bitCount(0), outputPtr(nullptr),
+    // Encodes the pixels of view in place with encode().
+    JPEGEncoder(const ImageView& image, int q)
+        : view(image), width(image.width), height(image.height), quality(std::max(1, std::min(100, q))),
+          components(3), dctMethod(DCTMethod::FLOAT), bitBuf(0), bitCount(0), outputPtr(nullptr),
           lastDCY(0), lastDCCb(0), lastDCCr(0) {
+        setBackground(255, 255, 255);
         initQuantTables();
         initHuffmanTables();
     }
 
+    // Packed RGB rows. The pixels are not copied: rgb_data must outlive
+    // encode(), so temporaries are refused. Throws if it is shorter than
+    // w * h * 3 bytes.
+    JPEGEncoder(const std::vector<uint8_t>& rgb_data, uint32_t w, uint32_t h, int q)
+        : JPEGEncoder(ImageView(checkedRGB(rgb_data, w, h), w, h, (size_t)w * 3, PixelFormat::RGB), q) {}
+    JPEGEncoder(std::vector<uint8_t>&&, uint32_t, uint32_t, int) = delete;
+
+    // For encoding from a pixel source with encode(pixels). There is no
+    // view, so encode() without a source throws.
+    JPEGEncoder(uint32_t w, uint32_t h, int q)
+        : JPEGEncoder(ImageView(nullptr, w, h, 0, PixelFormat::RGB), q) {}
+
+    void setDCTMethod(DCTMethod method) { dctMethod = method; }
+
+    void setBackground(uint8_t r, uint8_t g, uint8_t b) {
+        background[0] = r;
+        background[1] = g;
+        background[2] = b;
+    }
+
     std::vector<uint8_t> encode() {
+        if (!view.data) {
+            throw std::logic_error("JPEGEncoder has no image view to encode");
+        }
+        switch (view.format) {
+            case PixelFormat::GRAY: return encode(GrayPixels(view.data, view.stride));
+            case PixelFormat::GRAY_ALPHA: return encode(GrayAlphaPixels(view.data, view.stride, background));
+            case PixelFormat::RGB: return encode(RGBPixels(view.data, view.stride));
+            default: return encode(RGBAPixels(view.data, view.stride, background));
+        }
+    }
+
+    // Sources that turn out to be all gray, including RGB images with
+    // R == G == B everywhere, are written as a single-component JPEG.
+    template <typename Source>
+    std::vector<uint8_t> encode(const Source& pixels) {
         std::vector<uint8_t> output;
         outputPtr = &output;
+        components = pixels.grayscale(width, height) ? 1 : 3;
+        initDivisors(YTable, YReciprocals, YDivisors);
+        initDivisors(CbCrTable, CbCrReciprocals, CbCrDivisors);
         
         // SOI
         writeByte(0xFF);
@@ -519,7 +2967,11 @@ public:
         writeSOS();
         
         // Image data
-        encodeImageData();
+        if (dctMethod == DCTMethod::FLOAT) {
+            encodeImageData<float>(pixels);
+        } else {
+            encodeImageData<int16_t>(pixels);
+        }
         
         // EOI
         writeByte(0xFF);
@@ -529,6 +2981,13 @@ public:
     }
 
 private:
+    static const uint8_t* checkedRGB(const std::vector<uint8_t>& rgb, uint32_t w, uint32_t h) {
+        if (w != 0 && rgb.size() / 3 / w < h) {
+            throw std::invalid_argument("RGB buffer is smaller than width * height * 3");
+        }
+        return rgb.data();
+    }
+    
     void writeByte(uint8_t b) {
         outputPtr->push_back(b);
     }
@@ -550,6 +3009,60 @@ private:
         }
     }
     
+    // The float and fast DCTs leave coefficient (u, v) scaled by
+    // aanScale[u] * aanScale[v], and all three engines by a further 8.
+    void initDivisors(const int* quantTable, float* reciprocals, Divisors& divisors) {
+        divisors.wide = true;
+        for (int i = 0; i < 64; i++) {
+            double scale = (double)aanScale[i / 8] * aanScale[i % 8];
+            reciprocals[i] = (float)(1.0 / (quantTable[i] * scale * 8.0));
+            uint32_t divisor;
+            if (dctMethod == DCTMethod::IFAST) {
+                // The scale as 14-bit fixed point, as libjpeg tabulates it
+                int fixedScale = (int)(scale * 16384.0 + 0.5);
+                divisor = (quantTable[i] * fixedScale + (1 << 10)) >> 11;
+            } else {
+                divisor = quantTable[i] * 8;
+            }
+            setDivisor(divisors, i, divisor);
+        }
+    }
+    
+    // libjpeg-turbo's compute_reciprocal: the reciprocal is 2^shift / d
+    // rounded to 16 bits, and the correction, d / 2 plus one when the
+    // reciprocal was rounded down, makes the truncating product round to
+    // nearest. For 16-bit coefficients this equals dividing.
+    static void setDivisor(Divisors& divisors, int i, uint32_t divisor) {
+        if (divisor == 1) {
+            divisors.reciprocal[i] = 1;
+            divisors.correction[i] = 0;
+            divisors.shift[i] = 0;
+            divisors.scale[i] = 0;
+            divisors.wide = false;
+            return;
+        }
+        int bits = 0;
+        while ((2u << bits) <= divisor) bits++;
+        int shift = 16 + bits;
+        uint32_t reciprocal = (1u << shift) / divisor;
+        uint32_t remainder = (1u << shift) % divisor;
+        uint32_t correction = divisor / 2;
+        if (remainder == 0) {
+            // A power of two, whose reciprocal needs 17 bits at this shift
+            reciprocal >>= 1;
+            shift--;
+        } else if (remainder <= divisor / 2) {
+            correction++;
+        } else {
+            reciprocal++;
+        }
+        divisors.reciprocal[i] = (uint16_t)reciprocal;
+        divisors.correction[i] = (uint16_t)correction;
+        divisors.shift[i] = (uint8_t)shift;
+        divisors.scale[i] = shift > 16 ? (uint16_t)(1u << (32 - shift)) : 0;
+        divisors.wide = divisors.wide && shift > 16;
+    }
+    
     void computeHuffmanTable(const uint8_t* nrcodes, const uint8_t* values, uint16_t table[][2]) {
         uint16_t code = 0;
         int pos = 0;
@@ -594,6 +3107,7 @@ private:
         for (int i = 0; i < 64; i++) {
             writeByte(YTable[zigzag[i]]);
         }
+        if (components == 1) return;
         
         // Chrominance table (written in zigzag order)
         writeByte(0xFF);
@@ -608,16 +3122,17 @@ private:
     void writeSOF0() {
         writeByte(0xFF);
         writeByte(0xC0);
-        writeWord(17);              // Length
+        writeWord(8 + 3 * components);  // Length
         writeByte(8);               // Precision (8 bits)
         writeWord(height);
         writeWord(width);
-        writeByte(3);               // Number of components
+        writeByte(components);      // Number of components
         
         // Y component: ID=1, sampling=1x1, quant table=0
         writeByte(1);
         writeByte(0x11);
         writeByte(0);
+        if (components == 1) return;
         
         // Cb component: ID=2, sampling=1x1, quant table=1
         writeByte(2);
@@ -646,25 +3161,31 @@ private:
     
     void writeDHT() {
         writeHuffmanTable(0, 0, std_dc_luminance_nrcodes, std_dc_luminance_values, 12);
-        writeHuffmanTable(0, 1, std_dc_chrominance_nrcodes, std_dc_chrominance_values, 12);
+        if (components == 3) {
+            writeHuffmanTable(0, 1, std_dc_chrominance_nrcodes, std_dc_chrominance_values, 12);
+        }
         writeHuffmanTable(1, 0, std_ac_luminance_nrcodes, std_ac_luminance_values, 162);
-        writeHuffmanTable(1, 1, std_ac_chrominance_nrcodes, std_ac_chrominance_values, 162);
+        if (components == 3) {
+            writeHuffmanTable(1, 1, std_ac_chrominance_nrcodes, std_ac_chrominance_values, 162);
+        }
     }
     
     void writeSOS() {
         writeByte(0xFF);
         writeByte(0xDA);
-        writeWord(12);              // Length
-        writeByte(3);               // Number of components
+        writeWord(6 + 2 * components);  // Length
+        writeByte(components);      // Number of components
         
         writeByte(1);               // Y: component ID
         writeByte(0x00);            // Y: DC table 0, AC table 0
         
-        writeByte(2);               // Cb: component ID
-        writeByte(0x11);            // Cb: DC table 1, AC table 1
-        
-        writeByte(3);               // Cr: component ID
-        writeByte(0x11);            // Cr: DC table 1, AC table 1
+        if (components == 3) {
+            writeByte(2);           // Cb: component ID
+            writeByte(0x11);        // Cb: DC table 1, AC table 1
+            
+            writeByte(3);           // Cr: component ID
+            writeByte(0x11);        // Cr: DC table 1, AC table 1
+        }
         
         writeByte(0);               // Ss (start of spectral selection)
         writeByte(63);              // Se (end of spectral selection)
@@ -757,15 +3278,31 @@ private:
         }
     }
     
+    // The float DCT runs on 8-lane AVX when the CPU has it, else 4-lane
+    // SSE2. The vector versions transpose so that each lane works on its
+    // own row or column, and do the scalar code's operations in the same
+    // order, so all three produce identical coefficients.
     void forwardDCT(float* block) {
-        // AAN (Arai, Agui, Nakajima) fast DCT algorithm
-        const float c1 = 0.980785280f;  // cos(1*pi/16)
-        const float c2 = 0.923879533f;  // cos(2*pi/16) 
-        const float c3 = 0.831469612f;  // cos(3*pi/16)
+#ifdef JPEG_AVX_DISPATCH
+        if (hasAVX()) {
+            forwardDCTAVX(block);
+            return;
+        }
+#endif
+#ifdef PNG_SSE2
+        forwardDCTSSE(block);
+#else
+        forwardDCTScalar(block);
+#endif
+    }
+    
+    void forwardDCTScalar(float* block) {
+        // AAN (Arai, Agui, Nakajima) fast DCT algorithm. The outputs are
+        // left scaled by aanScale, which the quantizer divides back out.
         const float c4 = 0.707106781f;  // cos(4*pi/16) = 1/sqrt(2)
-        const float c5 = 0.555570233f;  // cos(5*pi/16)
-        const float c6 = 0.382683432f;  // cos(6*pi/16)
-        const float c7 = 0.195090322f;  // cos(7*pi/16)
+        const float c6 = 0.382683433f;  // cos(6*pi/16)
+        const float c2mc6 = 0.541196100f;  // cos(2*pi/16) - cos(6*pi/16)
+        const float c2pc6 = 1.306562965f;  // cos(2*pi/16) + cos(6*pi/16)
         
         // Process rows
         for (int i = 0; i < 8; i++) {
@@ -797,8 +3334,8 @@ private:
             tmp12 = tmp6 + tmp7;
             
             float z5 = (tmp10 - tmp12) * c6;
-            float z2 = tmp10 * c2 + z5;
-            float z4 = tmp12 * c6 + z5;
+            float z2 = tmp10 * c2mc6 + z5;
+            float z4 = tmp12 * c2pc6 + z5;
             float z3 = tmp11 * c4;
             
             float z11 = tmp7 + z3;
@@ -838,8 +3375,8 @@ private:
             tmp12 = tmp6 + tmp7;
             
             float z5 = (tmp10 - tmp12) * c6;
-            float z2 = tmp10 * c2 + z5;
-            float z4 = tmp12 * c6 + z5;
+            float z2 = tmp10 * c2mc6 + z5;
+            float z4 = tmp12 * c2pc6 + z5;
             float z3 = tmp11 * c4;
             
             float z11 = tmp7 + z3;
@@ -852,20 +3389,625 @@ private:
         }
     }
     
-    void processBlock(float* block, int* quantTable, int& lastDC, 
-                      uint16_t dcTable[][2], uint16_t acTable[][2]) {
-        // Forward DCT
-        forwardDCT(block);
+#ifdef PNG_SSE2
+    // One 1-D pass of the AAN DCT across v0..v7
+    static void dctPassSSE(__m128& v0, __m128& v1, __m128& v2, __m128& v3,
+                           __m128& v4, __m128& v5, __m128& v6, __m128& v7) {
+        const __m128 c4 = _mm_set1_ps(0.707106781f);
+        const __m128 c6 = _mm_set1_ps(0.382683433f);
+        const __m128 c2mc6 = _mm_set1_ps(0.541196100f);
+        const __m128 c2pc6 = _mm_set1_ps(1.306562965f);
+        
+        __m128 tmp0 = _mm_add_ps(v0, v7);
+        __m128 tmp7 = _mm_sub_ps(v0, v7);
+        __m128 tmp1 = _mm_add_ps(v1, v6);
+        __m128 tmp6 = _mm_sub_ps(v1, v6);
+        __m128 tmp2 = _mm_add_ps(v2, v5);
+        __m128 tmp5 = _mm_sub_ps(v2, v5);
+        __m128 tmp3 = _mm_add_ps(v3, v4);
+        __m128 tmp4 = _mm_sub_ps(v3, v4);
+        
+        __m128 tmp10 = _mm_add_ps(tmp0, tmp3);
+        __m128 tmp13 = _mm_sub_ps(tmp0, tmp3);
+        __m128 tmp11 = _mm_add_ps(tmp1, tmp2);
+        __m128 tmp12 = _mm_sub_ps(tmp1, tmp2);
+        
+        v0 = _mm_add_ps(tmp10, tmp11);
+        v4 = _mm_sub_ps(tmp10, tmp11);
+        
+        __m128 z1 = _mm_mul_ps(_mm_add_ps(tmp12, tmp13), c4);
+        v2 = _mm_add_ps(tmp13, z1);
+        v6 = _mm_sub_ps(tmp13, z1);
+        
+        tmp10 = _mm_add_ps(tmp4, tmp5);
+        tmp11 = _mm_add_ps(tmp5, tmp6);
+        tmp12 = _mm_add_ps(tmp6, tmp7);
+        
+        __m128 z5 = _mm_mul_ps(_mm_sub_ps(tmp10, tmp12), c6);
+        __m128 z2 = _mm_add_ps(_mm_mul_ps(tmp10, c2mc6), z5);
+        __m128 z4 = _mm_add_ps(_mm_mul_ps(tmp12, c2pc6), z5);
+        __m128 z3 = _mm_mul_ps(tmp11, c4);
+        
+        __m128 z11 = _mm_add_ps(tmp7, z3);
+        __m128 z13 = _mm_sub_ps(tmp7, z3);
+        
+        v5 = _mm_add_ps(z13, z2);
+        v3 = _mm_sub_ps(z13, z2);
+        v1 = _mm_add_ps(z11, z4);
+        v7 = _mm_sub_ps(z11, z4);
+    }
+    
+    static void forwardDCTSSE(float* block) {
+        // lo and hi hold columns 0-3 and 4-7 of each row
+        __m128 lo0 = _mm_loadu_ps(block + 0), hi0 = _mm_loadu_ps(block + 4);
+        __m128 lo1 = _mm_loadu_ps(block + 8), hi1 = _mm_loadu_ps(block + 12);
+        __m128 lo2 = _mm_loadu_ps(block + 16), hi2 = _mm_loadu_ps(block + 20);
+        __m128 lo3 = _mm_loadu_ps(block + 24), hi3 = _mm_loadu_ps(block + 28);
+        __m128 lo4 = _mm_loadu_ps(block + 32), hi4 = _mm_loadu_ps(block + 36);
+        __m128 lo5 = _mm_loadu_ps(block + 40), hi5 = _mm_loadu_ps(block + 44);
+        __m128 lo6 = _mm_loadu_ps(block + 48), hi6 = _mm_loadu_ps(block + 52);
+        __m128 lo7 = _mm_loadu_ps(block + 56), hi7 = _mm_loadu_ps(block + 60);
+        
+        // Rows, then columns, as in the scalar code. The 8x8 transpose
+        // transposes the 4x4 quarters and swaps the off-diagonal ones, so
+        // that register k holds element k of four rows (or columns).
+        for (int pass = 0; pass < 2; pass++) {
+            _MM_TRANSPOSE4_PS(lo0, lo1, lo2, lo3);
+            _MM_TRANSPOSE4_PS(hi0, hi1, hi2, hi3);
+            _MM_TRANSPOSE4_PS(lo4, lo5, lo6, lo7);
+            _MM_TRANSPOSE4_PS(hi4, hi5, hi6, hi7);
+            std::swap(hi0, lo4);
+            std::swap(hi1, lo5);
+            std::swap(hi2, lo6);
+            std::swap(hi3, lo7);
+            dctPassSSE(lo0, lo1, lo2, lo3, lo4, lo5, lo6, lo7);
+            dctPassSSE(hi0, hi1, hi2, hi3, hi4, hi5, hi6, hi7);
+        }
+        
+        _mm_storeu_ps(block + 0, lo0); _mm_storeu_ps(block + 4, hi0);
+        _mm_storeu_ps(block + 8, lo1); _mm_storeu_ps(block + 12, hi1);
+        _mm_storeu_ps(block + 16, lo2); _mm_storeu_ps(block + 20, hi2);
+        _mm_storeu_ps(block + 24, lo3); _mm_storeu_ps(block + 28, hi3);
+        _mm_storeu_ps(block + 32, lo4); _mm_storeu_ps(block + 36, hi4);
+        _mm_storeu_ps(block + 40, lo5); _mm_storeu_ps(block + 44, hi5);
+        _mm_storeu_ps(block + 48, lo6); _mm_storeu_ps(block + 52, hi6);
+        _mm_storeu_ps(block + 56, lo7); _mm_storeu_ps(block + 60, hi7);
+    }
+#endif
+
+#ifdef JPEG_AVX_DISPATCH
+    static bool hasAVX() {
+        static const bool supported = __builtin_cpu_supports("avx");
+        return supported;
+    }
+    
+    // AVX is enough here: 8-lane float arithmetic and the cross-lane
+    // shuffles for the transpose both predate AVX2.
+    __attribute__((target("avx")))
+    static void dctPassAVX(__m256& v0, __m256& v1, __m256& v2, __m256& v3,
+                           __m256& v4, __m256& v5, __m256& v6, __m256& v7) {
+        const __m256 c4 = _mm256_set1_ps(0.707106781f);
+        const __m256 c6 = _mm256_set1_ps(0.382683433f);
+        const __m256 c2mc6 = _mm256_set1_ps(0.541196100f);
+        const __m256 c2pc6 = _mm256_set1_ps(1.306562965f);
+        
+        __m256 tmp0 = _mm256_add_ps(v0, v7);
+        __m256 tmp7 = _mm256_sub_ps(v0, v7);
+        __m256 tmp1 = _mm256_add_ps(v1, v6);
+        __m256 tmp6 = _mm256_sub_ps(v1, v6);
+        __m256 tmp2 = _mm256_add_ps(v2, v5);
+        __m256 tmp5 = _mm256_sub_ps(v2, v5);
+        __m256 tmp3 = _mm256_add_ps(v3, v4);
+        __m256 tmp4 = _mm256_sub_ps(v3, v4);
+        
+        __m256 tmp10 = _mm256_add_ps(tmp0, tmp3);
+        __m256 tmp13 = _mm256_sub_ps(tmp0, tmp3);
+        __m256 tmp11 = _mm256_add_ps(tmp1, tmp2);
+        __m256 tmp12 = _mm256_sub_ps(tmp1, tmp2);
+        
+        v0 = _mm256_add_ps(tmp10, tmp11);
+        v4 = _mm256_sub_ps(tmp10, tmp11);
+        
+        __m256 z1 = _mm256_mul_ps(_mm256_add_ps(tmp12, tmp13), c4);
+        v2 = _mm256_add_ps(tmp13, z1);
+        v6 = _mm256_sub_ps(tmp13, z1);
+        
+        tmp10 = _mm256_add_ps(tmp4, tmp5);
+        tmp11 = _mm256_add_ps(tmp5, tmp6);
+        tmp12 = _mm256_add_ps(tmp6, tmp7);
+        
+        __m256 z5 = _mm256_mul_ps(_mm256_sub_ps(tmp10, tmp12), c6);
+        __m256 z2 = _mm256_add_ps(_mm256_mul_ps(tmp10, c2mc6), z5);
+        __m256 z4 = _mm256_add_ps(_mm256_mul_ps(tmp12, c2pc6), z5);
+        __m256 z3 = _mm256_mul_ps(tmp11, c4);
+        
+        __m256 z11 = _mm256_add_ps(tmp7, z3);
+        __m256 z13 = _mm256_sub_ps(tmp7, z3);
+        
+        v5 = _mm256_add_ps(z13, z2);
+        v3 = _mm256_sub_ps(z13, z2);
+        v1 = _mm256_add_ps(z11, z4);
+        v7 = _mm256_sub_ps(z11, z4);
+    }
+    
+    __attribute__((target("avx")))
+    static void transposeAVX(__m256& v0, __m256& v1, __m256& v2, __m256& v3,
+                             __m256& v4, __m256& v5, __m256& v6, __m256& v7) {
+        __m256 t0 = _mm256_unpacklo_ps(v0, v1);
+        __m256 t1 = _mm256_unpackhi_ps(v0, v1);
+        __m256 t2 = _mm256_unpacklo_ps(v2, v3);
+        __m256 t3 = _mm256_unpackhi_ps(v2, v3);
+        __m256 t4 = _mm256_unpacklo_ps(v4, v5);
+        __m256 t5 = _mm256_unpackhi_ps(v4, v5);
+        __m256 t6 = _mm256_unpacklo_ps(v6, v7);
+        __m256 t7 = _mm256_unpackhi_ps(v6, v7);
+        __m256 u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+        v0 = _mm256_permute2f128_ps(u0, u4, 0x20);
+        v1 = _mm256_permute2f128_ps(u1, u5, 0x20);
+        v2 = _mm256_permute2f128_ps(u2, u6, 0x20);
+        v3 = _mm256_permute2f128_ps(u3, u7, 0x20);
+        v4 = _mm256_permute2f128_ps(u0, u4, 0x31);
+        v5 = _mm256_permute2f128_ps(u1, u5, 0x31);
+        v6 = _mm256_permute2f128_ps(u2, u6, 0x31);
+        v7 = _mm256_permute2f128_ps(u3, u7, 0x31);
+    }
+    
+    __attribute__((target("avx")))
+    static void forwardDCTAVX(float* block) {
+        __m256 v0 = _mm256_loadu_ps(block + 0);
+        __m256 v1 = _mm256_loadu_ps(block + 8);
+        __m256 v2 = _mm256_loadu_ps(block + 16);
+        __m256 v3 = _mm256_loadu_ps(block + 24);
+        __m256 v4 = _mm256_loadu_ps(block + 32);
+        __m256 v5 = _mm256_loadu_ps(block + 40);
+        __m256 v6 = _mm256_loadu_ps(block + 48);
+        __m256 v7 = _mm256_loadu_ps(block + 56);
+        
+        // Rows, then columns, as in the scalar code
+        transposeAVX(v0, v1, v2, v3, v4, v5, v6, v7);
+        dctPassAVX(v0, v1, v2, v3, v4, v5, v6, v7);
+        transposeAVX(v0, v1, v2, v3, v4, v5, v6, v7);
+        dctPassAVX(v0, v1, v2, v3, v4, v5, v6, v7);
+        
+        _mm256_storeu_ps(block + 0, v0);
+        _mm256_storeu_ps(block + 8, v1);
+        _mm256_storeu_ps(block + 16, v2);
+        _mm256_storeu_ps(block + 24, v3);
+        _mm256_storeu_ps(block + 32, v4);
+        _mm256_storeu_ps(block + 40, v5);
+        _mm256_storeu_ps(block + 48, v6);
+        _mm256_storeu_ps(block + 56, v7);
+    }
+#endif
+    
+    // The integer DCTs work on 16-bit samples in 16-bit lanes, 8 at a time
+    // with SSE2, as libjpeg-turbo's do; only the products of the accurate
+    // DCT are carried in 32 bits. The scalar versions do the same
+    // arithmetic, so both give identical coefficients.
+    void forwardDCTIslow(int16_t* block) {
+#ifdef PNG_SSE2
+        forwardDCTIslowSSE2(block);
+#else
+        forwardDCTIslowScalar(block);
+#endif
+    }
+    
+    void forwardDCTIfast(int16_t* block) {
+#ifdef PNG_SSE2
+        forwardDCTIfastSSE2(block);
+#else
+        forwardDCTIfastScalar(block);
+#endif
+    }
+    
+    // Accurate fixed-point DCT (libjpeg's islow): 13-bit constants, with
+    // 2 extra bits of precision carried from the row pass to the column pass.
+    static const int CONST_BITS = 13;
+    static const int PASS1_BITS = 2;
+    static const int FIX_0_298631336 = 2446;
+    static const int FIX_0_390180644 = 3196;
+    static const int FIX_0_541196100 = 4433;
+    static const int FIX_0_765366865 = 6270;
+    static const int FIX_0_899976223 = 7373;
+    static const int FIX_1_175875602 = 9633;
+    static const int FIX_1_501321110 = 12299;
+    static const int FIX_1_847759065 = 15137;
+    static const int FIX_1_961570560 = 16069;
+    static const int FIX_2_053119869 = 16819;
+    static const int FIX_2_562915447 = 20995;
+    static const int FIX_3_072711026 = 25172;
+    
+    static void forwardDCTIslowScalar(int16_t* block) {
+        // Pass 1 works on rows, pass 2 on columns
+        for (int pass = 0; pass < 2; pass++) {
+            int step = pass == 0 ? 1 : 8;          // between the 8 inputs
+            int next = pass == 0 ? 8 : 1;          // to the next row or column
+            int fixedShift = pass == 0 ? CONST_BITS - PASS1_BITS : CONST_BITS + PASS1_BITS;
+            
+            for (int i = 0; i < 8; i++) {
+                int16_t* d = block + i * next;
+                
+                int tmp0 = d[0 * step] + d[7 * step];
+                int tmp7 = d[0 * step] - d[7 * step];
+                int tmp1 = d[1 * step] + d[6 * step];
+                int tmp6 = d[1 * step] - d[6 * step];
+                int tmp2 = d[2 * step] + d[5 * step];
+                int tmp5 = d[2 * step] - d[5 * step];
+                int tmp3 = d[3 * step] + d[4 * step];
+                int tmp4 = d[3 * step] - d[4 * step];
+                
+                // Even part
+                int tmp10 = tmp0 + tmp3;
+                int tmp13 = tmp0 - tmp3;
+                int tmp11 = tmp1 + tmp2;
+                int tmp12 = tmp1 - tmp2;
+                
+                if (pass == 0) {
+                    d[0 * step] = (int16_t)((tmp10 + tmp11) * (1 << PASS1_BITS));
+                    d[4 * step] = (int16_t)((tmp10 - tmp11) * (1 << PASS1_BITS));
+                } else {
+                    d[0 * step] = (int16_t)descale(tmp10 + tmp11, PASS1_BITS);
+                    d[4 * step] = (int16_t)descale(tmp10 - tmp11, PASS1_BITS);
+                }
+                
+                int z1 = (tmp12 + tmp13) * FIX_0_541196100;
+                d[2 * step] = (int16_t)descale(z1 + tmp13 * FIX_0_765366865, fixedShift);
+                d[6 * step] = (int16_t)descale(z1 - tmp12 * FIX_1_847759065, fixedShift);
+                
+                // Odd part
+                z1 = tmp4 + tmp7;
+                int z2 = tmp5 + tmp6;
+                int z3 = tmp4 + tmp6;
+                int z4 = tmp5 + tmp7;
+                int z5 = (z3 + z4) * FIX_1_175875602;
+                
+                tmp4 *= FIX_0_298631336;
+                tmp5 *= FIX_2_053119869;
+                tmp6 *= FIX_3_072711026;
+                tmp7 *= FIX_1_501321110;
+                z1 *= -FIX_0_899976223;
+                z2 *= -FIX_2_562915447;
+                z3 = z3 * -FIX_1_961570560 + z5;
+                z4 = z4 * -FIX_0_390180644 + z5;
+                
+                d[7 * step] = (int16_t)descale(tmp4 + z1 + z3, fixedShift);
+                d[5 * step] = (int16_t)descale(tmp5 + z2 + z4, fixedShift);
+                d[3 * step] = (int16_t)descale(tmp6 + z2 + z3, fixedShift);
+                d[1 * step] = (int16_t)descale(tmp7 + z1 + z4, fixedShift);
+            }
+        }
+    }
+    
+    // Fast fixed-point DCT (libjpeg's ifast): the AAN algorithm with 8-bit
+    // constants and truncating multiplies. Outputs are scaled like FLOAT's.
+    static const int FIX_0_382683433 = 98;
+    static const int FIX_0_541196100_8 = 139;
+    static const int FIX_0_707106781 = 181;
+    static const int FIX_1_306562965 = 334;
+    
+    static void forwardDCTIfastScalar(int16_t* block) {
+        for (int pass = 0; pass < 2; pass++) {
+            int step = pass == 0 ? 1 : 8;
+            int next = pass == 0 ? 8 : 1;
+            
+            for (int i = 0; i < 8; i++) {
+                int16_t* d = block + i * next;
+                
+                int tmp0 = d[0 * step] + d[7 * step];
+                int tmp7 = d[0 * step] - d[7 * step];
+                int tmp1 = d[1 * step] + d[6 * step];
+                int tmp6 = d[1 * step] - d[6 * step];
+                int tmp2 = d[2 * step] + d[5 * step];
+                int tmp5 = d[2 * step] - d[5 * step];
+                int tmp3 = d[3 * step] + d[4 * step];
+                int tmp4 = d[3 * step] - d[4 * step];
+                
+                int tmp10 = tmp0 + tmp3;
+                int tmp13 = tmp0 - tmp3;
+                int tmp11 = tmp1 + tmp2;
+                int tmp12 = tmp1 - tmp2;
+                
+                d[0 * step] = (int16_t)(tmp10 + tmp11);
+                d[4 * step] = (int16_t)(tmp10 - tmp11);
+                
+                int z1 = ((tmp12 + tmp13) * FIX_0_707106781) >> 8;
+                d[2 * step] = (int16_t)(tmp13 + z1);
+                d[6 * step] = (int16_t)(tmp13 - z1);
+                
+                tmp10 = tmp4 + tmp5;
+                tmp11 = tmp5 + tmp6;
+                tmp12 = tmp6 + tmp7;
+                
+                int z5 = ((tmp10 - tmp12) * FIX_0_382683433) >> 8;
+                int z2 = ((tmp10 * FIX_0_541196100_8) >> 8) + z5;
+                int z4 = ((tmp12 * FIX_1_306562965) >> 8) + z5;
+                int z3 = (tmp11 * FIX_0_707106781) >> 8;
+                
+                int z11 = tmp7 + z3;
+                int z13 = tmp7 - z3;
+                
+                d[5 * step] = (int16_t)(z13 + z2);
+                d[3 * step] = (int16_t)(z13 - z2);
+                d[1 * step] = (int16_t)(z11 + z4);
+                d[7 * step] = (int16_t)(z11 - z4);
+            }
+        }
+    }
+    
+#ifdef PNG_SSE2
+    // Register k ends up holding element k of the 8 rows
+    static void transposeSSE2(__m128i& v0, __m128i& v1, __m128i& v2, __m128i& v3,
+                              __m128i& v4, __m128i& v5, __m128i& v6, __m128i& v7) {
+        __m128i a0 = _mm_unpacklo_epi16(v0, v1);
+        __m128i a1 = _mm_unpackhi_epi16(v0, v1);
+        __m128i a2 = _mm_unpacklo_epi16(v2, v3);
+        __m128i a3 = _mm_unpackhi_epi16(v2, v3);
+        __m128i a4 = _mm_unpacklo_epi16(v4, v5);
+        __m128i a5 = _mm_unpackhi_epi16(v4, v5);
+        __m128i a6 = _mm_unpacklo_epi16(v6, v7);
+        __m128i a7 = _mm_unpackhi_epi16(v6, v7);
+        __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+        __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+        __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+        __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+        __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+        __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+        __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+        __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+        v0 = _mm_unpacklo_epi64(b0, b4);
+        v1 = _mm_unpackhi_epi64(b0, b4);
+        v2 = _mm_unpacklo_epi64(b1, b5);
+        v3 = _mm_unpackhi_epi64(b1, b5);
+        v4 = _mm_unpacklo_epi64(b2, b6);
+        v5 = _mm_unpackhi_epi64(b2, b6);
+        v6 = _mm_unpacklo_epi64(b3, b7);
+        v7 = _mm_unpackhi_epi64(b3, b7);
+    }
+    
+    // a * ca + b * cb in 32-bit lanes, for the low and high four pairs
+    struct ProductsSSE2 {
+        __m128i lo, hi;
+    };
+    
+    static ProductsSSE2 multiplyAddSSE2(__m128i a, __m128i b, int ca, int cb) {
+        const __m128i c = _mm_set1_epi32((int)(((uint32_t)cb << 16) | (uint16_t)ca));
+        ProductsSSE2 p = {_mm_madd_epi16(_mm_unpacklo_epi16(a, b), c),
+                          _mm_madd_epi16(_mm_unpackhi_epi16(a, b), c)};
+        return p;
+    }
+    
+    static ProductsSSE2 addSSE2(const ProductsSSE2& x, const ProductsSSE2& y) {
+        ProductsSSE2 p = {_mm_add_epi32(x.lo, y.lo), _mm_add_epi32(x.hi, y.hi)};
+        return p;
+    }
+    
+    template <int Shift>
+    static __m128i descaleSSE2(const ProductsSSE2& p) {
+        const __m128i round = _mm_set1_epi32(1 << (Shift - 1));
+        return _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(p.lo, round), Shift),
+                               _mm_srai_epi32(_mm_add_epi32(p.hi, round), Shift));
+    }
+    
+    // One islow pass across v0..v7. The products are regrouped as in
+    // libjpeg-turbo so each output is one or two pmaddwd pairs; the sums are
+    // the scalar code's, exactly.
+    template <int Pass>
+    static void islowPassSSE2(__m128i& v0, __m128i& v1, __m128i& v2, __m128i& v3,
+                              __m128i& v4, __m128i& v5, __m128i& v6, __m128i& v7) {
+        const int FIXED_SHIFT = Pass == 1 ? CONST_BITS - PASS1_BITS : CONST_BITS + PASS1_BITS;
+        
+        __m128i tmp0 = _mm_add_epi16(v0, v7);
+        __m128i tmp7 = _mm_sub_epi16(v0, v7);
+        __m128i tmp1 = _mm_add_epi16(v1, v6);
+        __m128i tmp6 = _mm_sub_epi16(v1, v6);
+        __m128i tmp2 = _mm_add_epi16(v2, v5);
+        __m128i tmp5 = _mm_sub_epi16(v2, v5);
+        __m128i tmp3 = _mm_add_epi16(v3, v4);
+        __m128i tmp4 = _mm_sub_epi16(v3, v4);
+        
+        // Even part
+        __m128i tmp10 = _mm_add_epi16(tmp0, tmp3);
+        __m128i tmp13 = _mm_sub_epi16(tmp0, tmp3);
+        __m128i tmp11 = _mm_add_epi16(tmp1, tmp2);
+        __m128i tmp12 = _mm_sub_epi16(tmp1, tmp2);
+        
+        if (Pass == 1) {
+            v0 = _mm_slli_epi16(_mm_add_epi16(tmp10, tmp11), PASS1_BITS);
+            v4 = _mm_slli_epi16(_mm_sub_epi16(tmp10, tmp11), PASS1_BITS);
+        } else {
+            const __m128i round = _mm_set1_epi16(1 << (PASS1_BITS - 1));
+            v0 = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(tmp10, tmp11), round), PASS1_BITS);
+            v4 = _mm_srai_epi16(_mm_add_epi16(_mm_sub_epi16(tmp10, tmp11), round), PASS1_BITS);
+        }
+        
+        v2 = descaleSSE2<FIXED_SHIFT>(multiplyAddSSE2(tmp13, tmp12, FIX_0_541196100 + FIX_0_765366865,
+                                                      FIX_0_541196100));
+        v6 = descaleSSE2<FIXED_SHIFT>(multiplyAddSSE2(tmp13, tmp12, FIX_0_541196100,
+                                                      FIX_0_541196100 - FIX_1_847759065));
+        
+        // Odd part
+        __m128i z3 = _mm_add_epi16(tmp4, tmp6);
+        __m128i z4 = _mm_add_epi16(tmp5, tmp7);
+        ProductsSSE2 z3p = multiplyAddSSE2(z3, z4, FIX_1_175875602 - FIX_1_961570560, FIX_1_175875602);
+        ProductsSSE2 z4p = multiplyAddSSE2(z3, z4, FIX_1_175875602, FIX_1_175875602 - FIX_0_390180644);
+        
+        ProductsSSE2 out7 = multiplyAddSSE2(tmp4, tmp7, FIX_0_298631336 - FIX_0_899976223, -FIX_0_899976223);
+        ProductsSSE2 out1 = multiplyAddSSE2(tmp4, tmp7, -FIX_0_899976223, FIX_1_501321110 - FIX_0_899976223);
+        ProductsSSE2 out5 = multiplyAddSSE2(tmp5, tmp6, FIX_2_053119869 - FIX_2_562915447, -FIX_2_562915447);
+        ProductsSSE2 out3 = multiplyAddSSE2(tmp5, tmp6, -FIX_2_562915447, FIX_3_072711026 - FIX_2_562915447);
+        
+        v7 = descaleSSE2<FIXED_SHIFT>(addSSE2(out7, z3p));
+        v5 = descaleSSE2<FIXED_SHIFT>(addSSE2(out5, z4p));
+        v3 = descaleSSE2<FIXED_SHIFT>(addSSE2(out3, z3p));
+        v1 = descaleSSE2<FIXED_SHIFT>(addSSE2(out1, z4p));
+    }
+    
+    // (x * c) >> 8 for 16-bit results, from the high and low halves of the
+    // 32-bit products
+    static __m128i multiplyShift8SSE2(__m128i x, int c) {
+        const __m128i constant = _mm_set1_epi16((int16_t)c);
+        return _mm_or_si128(_mm_slli_epi16(_mm_mulhi_epi16(x, constant), 8),
+                            _mm_srli_epi16(_mm_mullo_epi16(x, constant), 8));
+    }
+    
+    static void ifastPassSSE2(__m128i& v0, __m128i& v1, __m128i& v2, __m128i& v3,
+                              __m128i& v4, __m128i& v5, __m128i& v6, __m128i& v7) {
+        __m128i tmp0 = _mm_add_epi16(v0, v7);
+        __m128i tmp7 = _mm_sub_epi16(v0, v7);
+        __m128i tmp1 = _mm_add_epi16(v1, v6);
+        __m128i tmp6 = _mm_sub_epi16(v1, v6);
+        __m128i tmp2 = _mm_add_epi16(v2, v5);
+        __m128i tmp5 = _mm_sub_epi16(v2, v5);
+        __m128i tmp3 = _mm_add_epi16(v3, v4);
+        __m128i tmp4 = _mm_sub_epi16(v3, v4);
         
-        // Quantize and reorder to zigzag sequence for encoding
-        // zigzag[i] gives the natural (row-major) index for zigzag position i
+        __m128i tmp10 = _mm_add_epi16(tmp0, tmp3);
+        __m128i tmp13 = _mm_sub_epi16(tmp0, tmp3);
+        __m128i tmp11 = _mm_add_epi16(tmp1, tmp2);
+        __m128i tmp12 = _mm_sub_epi16(tmp1, tmp2);
+        
+        v0 = _mm_add_epi16(tmp10, tmp11);
+        v4 = _mm_sub_epi16(tmp10, tmp11);
+        
+        __m128i z1 = multiplyShift8SSE2(_mm_add_epi16(tmp12, tmp13), FIX_0_707106781);
+        v2 = _mm_add_epi16(tmp13, z1);
+        v6 = _mm_sub_epi16(tmp13, z1);
+        
+        tmp10 = _mm_add_epi16(tmp4, tmp5);
+        tmp11 = _mm_add_epi16(tmp5, tmp6);
+        tmp12 = _mm_add_epi16(tmp6, tmp7);
+        
+        __m128i z5 = multiplyShift8SSE2(_mm_sub_epi16(tmp10, tmp12), FIX_0_382683433);
+        __m128i z2 = _mm_add_epi16(multiplyShift8SSE2(tmp10, FIX_0_541196100_8), z5);
+        __m128i z4 = _mm_add_epi16(multiplyShift8SSE2(tmp12, FIX_1_306562965), z5);
+        __m128i z3 = multiplyShift8SSE2(tmp11, FIX_0_707106781);
+        
+        __m128i z11 = _mm_add_epi16(tmp7, z3);
+        __m128i z13 = _mm_sub_epi16(tmp7, z3);
+        
+        v5 = _mm_add_epi16(z13, z2);
+        v3 = _mm_sub_epi16(z13, z2);
+        v1 = _mm_add_epi16(z11, z4);
+        v7 = _mm_sub_epi16(z11, z4);
+    }
+    
+    // Rows, then columns: each transpose puts one row or column per lane
+    template <bool Islow>
+    static void forwardDCTIntSSE2(int16_t* block) {
+        __m128i* rows = reinterpret_cast<__m128i*>(block);
+        __m128i v0 = _mm_loadu_si128(rows + 0);
+        __m128i v1 = _mm_loadu_si128(rows + 1);
+        __m128i v2 = _mm_loadu_si128(rows + 2);
+        __m128i v3 = _mm_loadu_si128(rows + 3);
+        __m128i v4 = _mm_loadu_si128(rows + 4);
+        __m128i v5 = _mm_loadu_si128(rows + 5);
+        __m128i v6 = _mm_loadu_si128(rows + 6);
+        __m128i v7 = _mm_loadu_si128(rows + 7);
+        
+        transposeSSE2(v0, v1, v2, v3, v4, v5, v6, v7);
+        if (Islow) {
+            islowPassSSE2<1>(v0, v1, v2, v3, v4, v5, v6, v7);
+        } else {
+            ifastPassSSE2(v0, v1, v2, v3, v4, v5, v6, v7);
+        }
+        transposeSSE2(v0, v1, v2, v3, v4, v5, v6, v7);
+        if (Islow) {
+            islowPassSSE2<2>(v0, v1, v2, v3, v4, v5, v6, v7);
+        } else {
+            ifastPassSSE2(v0, v1, v2, v3, v4, v5, v6, v7);
+        }
+        
+        _mm_storeu_si128(rows + 0, v0);
+        _mm_storeu_si128(rows + 1, v1);
+        _mm_storeu_si128(rows + 2, v2);
+        _mm_storeu_si128(rows + 3, v3);
+        _mm_storeu_si128(rows + 4, v4);
+        _mm_storeu_si128(rows + 5, v5);
+        _mm_storeu_si128(rows + 6, v6);
+        _mm_storeu_si128(rows + 7, v7);
+    }
+    
+    static void forwardDCTIslowSSE2(int16_t* block) { forwardDCTIntSSE2<true>(block); }
+    static void forwardDCTIfastSSE2(int16_t* block) { forwardDCTIntSSE2<false>(block); }
+#endif
+    
+    // Right shift with rounding
+    static int descale(int x, int n) {
+        return (x + (1 << (n - 1))) >> n;
+    }
+    
+    // Quantizes the 64 coefficients in natural order. The SSE2 version takes
+    // magnitudes, so the unsigned multiplies round halves away from zero as
+    // the scalar one does.
+    static void quantize(const int16_t* coefficients, const Divisors& divisors, int16_t* out) {
+#ifdef PNG_SSE2
+        if (divisors.wide) {
+            quantizeSSE2(coefficients, divisors, out);
+            return;
+        }
+#endif
+        for (int i = 0; i < 64; i++) {
+            int coefficient = coefficients[i];
+            uint32_t magnitude = (uint32_t)(coefficient < 0 ? -coefficient : coefficient);
+            uint32_t q = ((magnitude + divisors.correction[i]) * divisors.reciprocal[i]) >> divisors.shift[i];
+            out[i] = (int16_t)(coefficient < 0 ? -(int)q : (int)q);
+        }
+    }
+    
+#ifdef PNG_SSE2
+    static void quantizeSSE2(const int16_t* coefficients, const Divisors& divisors, int16_t* out) {
+        for (int i = 0; i < 64; i += 8) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(coefficients + i));
+            __m128i sign = _mm_srai_epi16(x, 15);
+            __m128i magnitude = _mm_sub_epi16(_mm_xor_si128(x, sign), sign);
+            magnitude = _mm_add_epi16(magnitude, _mm_loadu_si128(reinterpret_cast<const __m128i*>(divisors.correction + i)));
+            magnitude = _mm_mulhi_epu16(magnitude, _mm_loadu_si128(reinterpret_cast<const __m128i*>(divisors.reciprocal + i)));
+            magnitude = _mm_mulhi_epu16(magnitude, _mm_loadu_si128(reinterpret_cast<const __m128i*>(divisors.scale + i)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_sub_epi16(_mm_xor_si128(magnitude, sign), sign));
+        }
+    }
+#endif
+    
+    // Forward DCT, then quantize and reorder to zigzag sequence for
+    // encoding. zigzag[i] gives the natural (row-major) index for zigzag
+    // position i
+    void processBlock(float* block, int table, int& lastDC,
+                      uint16_t dcTable[][2], uint16_t acTable[][2]) {
         int quantized[64];
+        forwardDCT(block);
+        const float* reciprocals = table == 0 ? YReciprocals : CbCrReciprocals;
         for (int i = 0; i < 64; i++) {
             int naturalIdx = zigzag[i];
-            float val = block[naturalIdx] / (quantTable[naturalIdx] * 8.0f);
+            float val = block[naturalIdx] * reciprocals[naturalIdx];
             quantized[i] = (int)((val > 0) ? (val + 0.5f) : (val - 0.5f));
         }
-        
+        encodeBlock(quantized, lastDC, dcTable, acTable);
+    }
+    
+    void processBlock(int16_t* block, int table, int& lastDC,
+                      uint16_t dcTable[][2], uint16_t acTable[][2]) {
+        if (dctMethod == DCTMethod::ISLOW) {
+            forwardDCTIslow(block);
+        } else {
+            forwardDCTIfast(block);
+        }
+        int16_t coefficients[64];
+        quantize(block, table == 0 ? YDivisors : CbCrDivisors, coefficients);
+        int quantized[64];
+        for (int i = 0; i < 64; i++) {
+            quantized[i] = coefficients[zigzag[i]];
+        }
+        encodeBlock(quantized, lastDC, dcTable, acTable);
+    }
+    
+    void encodeBlock(int* quantized, int& lastDC, uint16_t dcTable[][2], uint16_t acTable[][2]) {
         // Encode DC coefficient
         int dcVal = quantized[0] - lastDC;
         lastDC = quantized[0];
@@ -875,40 +4017,42 @@ private:
         encodeAC(quantized, acTable);
     }
     
-    void encodeImageData() {
+    // Sample is float for the float DCT and int16_t for the integer ones
+    template <typename Sample, typename Source>
+    void encodeImageData(const Source& pixels) {
         lastDCY = lastDCCb = lastDCCr = 0;
         
         // Process image in 8x8 blocks
         for (uint32_t y = 0; y < height; y += 8) {
             for (uint32_t x = 0; x < width; x += 8) {
-                float blockY[64], blockCb[64], blockCr[64];
+                Sample blockY[64], blockCb[64], blockCr[64];
                 
-                // Extract and convert RGB to YCbCr
+                // Extract YCbCr pixels
+                uint32_t count = std::min<uint32_t>(8, width - x);
                 for (int by = 0; by < 8; by++) {
-                    for (int bx = 0; bx < 8; bx++) {
-                        uint32_t py = std::min(y + by, height - 1);
-                        uint32_t px = std::min(x + bx, width - 1);
-                        size_t idx = (py * width + px) * 3;
-                        
-                        float r = rgb[idx];
-                        float g = rgb[idx + 1];
-                        float b = rgb[idx + 2];
-                        
-                        // RGB to YCbCr conversion (level shifted by -128)
-                        blockY[by * 8 + bx]  =  0.299f * r + 0.587f * g + 0.114f * b - 128.0f;
-                        blockCb[by * 8 + bx] = -0.168736f * r - 0.331264f * g + 0.5f * b;
-                        blockCr[by * 8 + bx] =  0.5f * r - 0.418688f * g - 0.081312f * b;
+                    uint32_t py = std::min(y + by, height - 1);
+                    Sample* rowY = &blockY[by * 8];
+                    Sample* rowCb = &blockCb[by * 8];
+                    Sample* rowCr = &blockCr[by * 8];
+                    pixels.row(x, py, count, rowY, rowCb, rowCr);
+                    
+                    // Columns past the right edge repeat the last pixel
+                    for (uint32_t bx = count; bx < 8; bx++) {
+                        rowY[bx] = rowY[count - 1];
+                        rowCb[bx] = rowCb[count - 1];
+                        rowCr[bx] = rowCr[count - 1];
                     }
                 }
                 
                 // Process Y block
-                processBlock(blockY, YTable, lastDCY, YDC_HT, YAC_HT);
+                processBlock(blockY, 0, lastDCY, YDC_HT, YAC_HT);
+                if (components == 1) continue;
                 
                 // Process Cb block
-                processBlock(blockCb, CbCrTable, lastDCCb, UVDC_HT, UVAC_HT);
+                processBlock(blockCb, 1, lastDCCb, UVDC_HT, UVAC_HT);
                 
                 // Process Cr block
-                processBlock(blockCr, CbCrTable, lastDCCr, UVDC_HT, UVAC_HT);
+                processBlock(blockCr, 1, lastDCCr, UVDC_HT, UVAC_HT);
             }
         }
         
@@ -941,6 +4085,11 @@ const uint8_t JPEGEncoder::std_chrominance_quant[64] = {
 };
 
 // Zigzag order
+// AAN output scale of each frequency: 1 for DC, cos(k*pi/16) * sqrt(2) otherwise
+const float JPEGEncoder::aanScale[8] = {
+    1.0f, 1.387039845f, 1.306562965f, 1.175875602f, 1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+};
+
 const uint8_t JPEGEncoder::zigzag[64] = {
     0,  1,  8, 16,  9,  2,  3, 10,
     17, 24, 32, 25, 18, 11,  4,  5,
@@ -1014,40 +4163,240 @@ const uint8_t JPEGEncoder::std_ac_chrominance_values[162] = {
 
 // ============= MAIN CONVERTER =============
 
+static void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " <input.png> <output.jpg> [quality 1-100] [--crop x,y,w,h]\n"
+              << "       " << std::string(std::strlen(program), ' ') << "  [--background r,g,b] [--dct float|islow|ifast]\n"
+              << "       " << program << " --build-index <input.png>\n"
+              << "       " << program << " --probe <input.png>\n";
+}
+
+// Depths other than 8 are converted to one byte per sample a band of rows
+// at a time, as the encoder reaches them, so the converted image is never
+// held whole.
+static bool encodeConverted(const PNGDecoder& decoder, uint32_t left, uint32_t width, int quality,
+                            DCTMethod dct, const uint8_t background[3], std::vector<uint8_t>& jpegData) {
+    PNGDecoder::ByteRows rows(decoder);
+    uint32_t height = decoder.getHeight();
+    size_t stride = rows.rowBytes();
+    std::vector<uint8_t> band(BAND_ROWS * stride + PNGDecoder::ByteRows::SLACK);
+    uint8_t* pixels = band.data();
+
+    JPEGEncoder encoder(width, height, quality);
+    encoder.setDCTMethod(dct);
+    switch (rows.colorType()) {
+        case 0:
+            jpegData = encoder.encode(bandedPixels(GrayPixels(pixels + left, stride), rows, pixels, height, false));
+            break;
+        case 2:
+            jpegData = encoder.encode(bandedPixels(RGBPixels(pixels + (size_t)left * 3, stride),
+                                                   rows, pixels, height, true));
+            break;
+        case 3:
+            jpegData = encoder.encode(bandedPixels(PalettePixels(pixels + left, stride, decoder.getPalette(),
+                                                                 decoder.getTransparency(), background),
+                                                   rows, pixels, height, false));
+            break;
+        case 4:
+            jpegData = encoder.encode(bandedPixels(GrayAlphaPixels(pixels + (size_t)left * 2, stride, background),
+                                                   rows, pixels, height, false));
+            break;
+        case 6:
+            jpegData = encoder.encode(bandedPixels(RGBAPixels(pixels + (size_t)left * 4, stride, background),
+                                                   rows, pixels, height, true));
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+// 8-bit images are encoded straight from the decoder's rows, cropped to
+// the width columns starting at left. Transparent pixels are composited
+// onto background.
+static bool encodeDecoded(const PNGDecoder& decoder, uint32_t left, uint32_t width, int quality,
+                          DCTMethod dct, const uint8_t background[3], std::vector<uint8_t>& jpegData) {
+    if (decoder.getHeader().bitDepth != 8) {
+        return encodeConverted(decoder, left, width, quality, dct, background, jpegData);
+    }
+    const uint8_t* pixels = decoder.getPixels();
+    size_t stride = decoder.getStride();
+    uint32_t height = decoder.getHeight();
+    uint8_t colorType = decoder.getHeader().colorType;
+    uint8_t key[3];
+    bool keyed = decoder.getColorKey(key);
+
+    // Color keys and palettes need more than a view can describe.
+    if (keyed || colorType == 3) {
+        JPEGEncoder encoder(width, height, quality);
+        encoder.setDCTMethod(dct);
+        if (colorType == 3) {
+            jpegData = encoder.encode(PalettePixels(pixels + left, stride, decoder.getPalette(),
+                                                    decoder.getTransparency(), background));
+        } else if (colorType == 0) {
+            jpegData = encoder.encode(KeyedPixels<1>(pixels + left, stride, key, background));
+        } else {
+            jpegData = encoder.encode(KeyedPixels<3>(pixels + (size_t)left * 3, stride, key, background));
+        }
+        return true;
+    }
+
+    PixelFormat format;
+    switch (colorType) {
+        case 0: format = PixelFormat::GRAY; break;
+        case 2: format = PixelFormat::RGB; break;
+        case 4: format = PixelFormat::GRAY_ALPHA; break;
+        case 6: format = PixelFormat::RGBA; break;
+        default: return false;
+    }
+    ImageView image(pixels, decoder.getWidth(), height, stride, format);
+    JPEGEncoder encoder(image.crop(left, 0, width, height), quality);
+    encoder.setBackground(background[0], background[1], background[2]);
+    encoder.setDCTMethod(dct);
+    jpegData = encoder.encode();
+    return true;
+}
+
+static const char* colorTypeName(uint8_t colorType) {
+    switch (colorType) {
+        case 0: return "grayscale";
+        case 2: return "RGB";
+        case 3: return "palette";
+        case 4: return "grayscale + alpha";
+        case 6: return "RGBA";
+        default: return "unknown";
+    }
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <input.png> <output.jpg> [quality 1-100]\n";
+    if (argc == 3 && std::string(argv[1]) == "--probe") {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        PNGDecoder decoder;
+        PNGInfo info;
+        if (!decoder.probe(argv[2], info)) {
+            std::cerr << "Failed to read PNG header\n";
+            return 1;
+        }
+        long long micros = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+        std::cout << "Dimensions: " << info.header.width << "x" << info.header.height << "\n"
+                  << "Bit depth: " << (int)info.header.bitDepth << "\n"
+                  << "Color type: " << (int)info.header.colorType << " (" << colorTypeName(info.header.colorType) << ")\n"
+                  << "Interlace: " << (info.header.interlaceMethod ? "Adam7" : "none") << "\n"
+                  << "IDAT: " << info.idatBytes << " bytes in " << info.idatChunks << " chunks"
+                  << (info.segmented ? " (iDOT segmented)" : "") << "\n"
+                  << "Estimated decode memory: " << info.decodeBytes << " bytes\n"
+                  << "Probe time: " << micros << " us" << std::endl;
+        return 0;
+    }
+
+    if (argc == 3 && std::string(argv[1]) == "--build-index") {
+        std::string inputFile = argv[2];
+        PNGDecoder decoder;
+        PNGIndex index;
+        if (!decoder.buildIndex(inputFile, index)) {
+            std::cerr << "Failed to index PNG file\n";
+            return 1;
+        }
+        std::string indexFile = PNGIndex::sidecarName(inputFile);
+        if (!index.save(indexFile)) {
+            std::cerr << "Failed to write index file\n";
+            return 1;
+        }
+        std::cout << "Wrote " << index.points.size() << " checkpoints to: " << indexFile << std::endl;
+        return 0;
+    }
+
+    std::vector<std::string> args;
+    bool crop = false;
+    uint8_t background[3] = {255, 255, 255};
+    DCTMethod dct = DCTMethod::FLOAT;
+    uint32_t cropX = 0, cropY = 0, cropW = 0, cropH = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--crop" && i + 1 < argc) {
+            if (std::sscanf(argv[++i], "%u,%u,%u,%u", &cropX, &cropY, &cropW, &cropH) != 4 ||
+                cropW == 0 || cropH == 0) {
+                std::cerr << "Invalid crop rectangle: " << argv[i] << "\n";
+                return 1;
+            }
+            crop = true;
+        } else if (arg == "--dct" && i + 1 < argc) {
+            std::string method = argv[++i];
+            if (method == "float") {
+                dct = DCTMethod::FLOAT;
+            } else if (method == "islow") {
+                dct = DCTMethod::ISLOW;
+            } else if (method == "ifast") {
+                dct = DCTMethod::IFAST;
+            } else {
+                std::cerr << "Unknown DCT method: " << method << "\n";
+                return 1;
+            }
+        } else if (arg == "--background" && i + 1 < argc) {
+            unsigned r, g, b;
+            if (std::sscanf(argv[++i], "%u,%u,%u", &r, &g, &b) != 3 || r > 255 || g > 255 || b > 255) {
+                std::cerr << "Invalid background color: " << argv[i] << "\n";
+                return 1;
+            }
+            background[0] = (uint8_t)r;
+            background[1] = (uint8_t)g;
+            background[2] = (uint8_t)b;
+        } else {
+            args.push_back(arg);
+        }
+    }
+
+    if (args.size() < 2) {
+        printUsage(argv[0]);
         return 1;
     }
 
-    std::string inputFile = argv[1];
-    std::string outputFile = argv[2];
+    std::string inputFile = args[0];
+    std::string outputFile = args[1];
     int quality = 85;
 
-    if (argc > 3) {
-        quality = std::atoi(argv[3]);
+    if (args.size() > 2) {
+        quality = std::atoi(args[2].c_str());
     }
 
     std::cout << "Loading PNG: " << inputFile << std::endl;
 
     PNGDecoder decoder;
-    if (!decoder.load(inputFile)) {
+    bool loaded;
+    if (crop) {
+        // A sidecar index from --build-index lets the decoder skip the rows
+        // above the crop; without one the whole image is decoded.
+        loaded = decoder.loadRows(inputFile, cropY, cropH, PNGIndex::sidecarName(inputFile));
+    } else {
+        loaded = decoder.load(inputFile);
+    }
+    if (!loaded) {
         std::cerr << "Failed to load PNG file\n";
         return 1;
     }
 
-    std::cout << "PNG loaded: " << decoder.getWidth() << "x" << decoder.getHeight() << std::endl;
+    uint32_t width = decoder.getWidth();
+    uint32_t height = decoder.getHeight();
+    std::cout << "PNG loaded: " << width << "x" << height << std::endl;
 
-    std::vector<uint8_t> rgb = decoder.getRGB();
-    if (rgb.empty()) {
-        std::cerr << "Failed to extract RGB data\n";
-        return 1;
+    uint32_t left = 0;
+    if (crop) {
+        if (cropX >= width || cropW > width - cropX) {
+            std::cerr << "Crop rectangle outside the image\n";
+            return 1;
+        }
+        left = cropX;
+        width = cropW;
     }
 
     std::cout << "Encoding JPEG with quality " << quality << "..." << std::endl;
 
-    JPEGEncoder encoder(rgb, decoder.getWidth(), decoder.getHeight(), quality);
-    std::vector<uint8_t> jpegData = encoder.encode();
+    std::vector<uint8_t> jpegData;
+    if (!encodeDecoded(decoder, left, width, quality, dct, background, jpegData)) {
+        std::cerr << "Failed to extract RGB data\n";
+        return 1;
+    }
 
     std::ofstream outFile(outputFile, std::ios::binary);
     if (!outFile) {